@@ -1,7 +1,90 @@
+#define _GNU_SOURCE // Exposes vmsplice on Linux
 #include <stdio.h>
 #include <stdlib.h>
 #define _CRT_SECURE_NO_WARNINGS
 #include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <time.h>
+
+#if !defined(_WIN32) // Output written by separate thread, link with -pthread
+#define OUT_ASYNC
+#define HAVE_PTHREADS // Top talkers counted by several threads
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__linux__) // Output pages spliced directly into pipes
+#define OUT_SPLICE
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#if !defined(_WIN32) // Growing captures can be followed as they are written
+#define HAVE_FOLLOW
+#include <fcntl.h>
+#include <signal.h>
+#endif
+
+#if defined(__linux__) // Followed captures are watched with inotify instead of polled
+#define FOLLOW_INOTIFY
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#if defined(_WIN32) // Aligned allocation of capture writer buffers
+#include <malloc.h>
+#endif
+
+#if defined(__SSSE3__) // Byte shuffles for search prefilter always used
+#include <tmmintrin.h>
+#define AC_SHUFFLE
+#define AC_TARGET
+#define AC_HAVE_SHUFFLE() 1
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) // Used if CPU supports it
+#include <tmmintrin.h>
+#define AC_SHUFFLE
+#define AC_TARGET __attribute__((target("ssse3")))
+#define AC_HAVE_SHUFFLE() __builtin_cpu_supports("ssse3")
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) // Byte compares available for search prefilter
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__) // Vector batch decoding always used
+#include <immintrin.h>
+#define BATCH_VECTOR
+#define BATCH_TARGET
+#define BATCH_HAVE_VECTOR() 1
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) // Used if CPU supports it
+#include <immintrin.h>
+#define BATCH_VECTOR
+#define BATCH_TARGET __attribute__((target("avx2")))
+#define BATCH_HAVE_VECTOR() __builtin_cpu_supports("avx2")
+#else
+#define BATCH_HAVE_VECTOR() 0
+#endif
+#define BATCH_ISA (BATCH_HAVE_VECTOR() ? "AVX2" : "scalar")
+
+#if defined(__AES__) // AES rounds in hardware for address anonymization always used
+#include <wmmintrin.h>
+#define ANON_AESNI
+#define ANON_TARGET
+#define ANON_HAVE_AESNI() 1
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) // Used if CPU supports it
+#include <wmmintrin.h>
+#define ANON_AESNI
+#define ANON_TARGET __attribute__((target("aes,sse2")))
+#define ANON_HAVE_AESNI() __builtin_cpu_supports("aes")
+#else
+#define ANON_HAVE_AESNI() 0
+#endif
+#define ANON_ISA (ANON_HAVE_AESNI() ? "AES-NI" : "scalar")
 
 // Label for Ethernet packet fields
 #define ETHERNET_LBL "Ethernet header:\n----------------"
@@ -14,10 +97,6 @@
 #define MAC_ADDR_LEN 6 // MAC address length
 #define MAC_ADDR_DELIM ":" // MAC address byte delimiter
 
-// Type Field Format
-#define TYPE_LEN 2 // Length of type field
-#define TYPE_DELIM "" // Delimiter between type field bytes
-
 // IP Header Format
 #define IP_LBL "\n\nIPv4 Header:\n----------------"
 #define VER_LBL "\nVersion:\t\t\t"
@@ -65,6 +144,58 @@
 #define TCP_OPT_LBL "\nTCP Option word #"
 #define TCP_NO_OPT_LBL "\nOptions:\t\t\tNo Options"
 
+// Header Schemas
+// Each field is X(header type, name, byte offset, bit shift, bit width, label, render function)
+// Bit shift counts up from least significant bit of big-endian bytes holding field
+// Fields are rendered in table order, adding a field only needs a new entry
+// Extractors and printers are generated from these tables by DEFINE_HEADER_CODEC
+#define ETH_FIELDS(X, T) \
+    X(T, destMAC,    0,  0, 48, MAC_DEST_LBL,     renderMAC) \
+    X(T, srcMAC,     6,  0, 48, MAC_SRC_LBL,      renderMAC) \
+    X(T, type,       12, 0, 16, TYPE_LBL,         renderHex4)
+
+#define IP_FIELDS(X, T) \
+    X(T, version,    0,  4, 4,  VER_LBL,          renderHex2) \
+    X(T, ihl,        0,  0, 4,  HLEN_LBL,         renderHex2) \
+    X(T, dscp,       1,  2, 6,  DSCP_LBL,         renderHex2) \
+    X(T, ecn,        1,  0, 2,  ECN_LBL,          renderECN) \
+    X(T, totalLen,   2,  0, 16, LEN_LBL,          renderDec) \
+    X(T, ident,      4,  0, 16, ID_LBL,           renderDec) \
+    X(T, flags,      6,  5, 3,  FLAGS_LBL,        renderFragFlags) \
+    X(T, fragOffset, 6,  0, 13, FRAG_OFF_LBL,     renderDec) \
+    X(T, ttl,        8,  0, 8,  TTL_LBL,          renderDec) \
+    X(T, protocol,   9,  0, 8,  PROTOCOL_LBL,     renderDec) \
+    X(T, checksum,   10, 0, 16, IP_CHECKSUM_LBL,  renderHex4) \
+    X(T, srcIP,      12, 0, 32, IP_SRC_LBL,       renderIPv4) \
+    X(T, destIP,     16, 0, 32, IP_DEST_LBL,      renderIPv4)
+
+#define TCP_FIELDS(X, T) \
+    X(T, srcPort,    0,  0, 16, SRC_PORT_LBL,     renderDec) \
+    X(T, destPort,   2,  0, 16, DEST_PORT_LBL,    renderDec) \
+    X(T, seqNum,     4,  0, 32, SEQ_NUM_LBL,      renderDec) \
+    X(T, ackNum,     8,  0, 32, ACK_NUM_LBL,      renderDec) \
+    X(T, dataOffset, 12, 4, 4,  DATA_OFS_LBL,     renderDec) \
+    X(T, flags,      13, 0, 8,  TCP_FLAGS_LBL,    renderTCPFlags) \
+    X(T, window,     14, 0, 16, WINDOW_SIZE_LBL,  renderDec) \
+    X(T, checksum,   16, 0, 16, TCP_CHECKSUM_LBL, renderHex2) \
+    X(T, urgentPtr,  18, 0, 16, TCP_URG_PTR_LBL,  renderDec)
+
+// Schema field generators
+#define DECLARE_FIELD(type, name, ofs, shift, width, label, render) uint64_t name;
+#define DEFINE_GETTER(type, name, ofs, shift, width, label, render) \
+    static inline uint64_t get##type##_##name(const uint8_t* raw) { \
+        return (readBitsBE(raw + (ofs), ((shift) + (width) + 7) / 8) >> (shift)) & (~0ULL >> (64 - (width))); \
+    }
+#define EXTRACT_FIELD(type, name, ofs, shift, width, label, render) hdr->name = get##type##_##name(raw);
+#define RENDER_FIELD(type, name, ofs, shift, width, label, render) render(label, hdr->name);
+
+// Defines get<type>_<field> for each field of `fields` schema, returning field from raw header bytes,
+// parse<type>, extracting every field, and render<type>, printing every field in schema order
+#define DEFINE_HEADER_CODEC(type, fields) \
+    fields(DEFINE_GETTER, type) \
+    static inline void parse##type(const uint8_t* raw, type* hdr) { fields(EXTRACT_FIELD, type) } \
+    static inline void render##type(const type* hdr) { fields(RENDER_FIELD, type) }
+
 
 // Payload Format
 #define PAYLOAD_DELIM " " // Delimiter between each individual payload byte
@@ -72,15 +203,191 @@
 #define PAYLOAD_ROW_DELIM "\n" // Delimiter separating payload rows
 #define PAYLOAD_COL_WIDTH 8 // Width of columns in payload 
 #define PAYLOAD_NUM_COLS 4 // Number of columns in payload
+#define PAYLOAD_ASCII_DELIM "   |" // Delimiter separating hex bytes from ASCII column
+#define PAYLOAD_ASCII_END "|" // Printed after ASCII column of each row
+#define PAYLOAD_ASCII_PAD "  " // Stands in for missing bytes so ASCII column aligns
+#define PAYLOAD_NON_PRINT '.' // Displayed in ASCII column for non-printable bytes
+#define PAYLOAD_SNAP_LBL "\n[%ld payload bytes not shown]" // Bytes skipped by snap length
+
+// Command-line Options
+#define OPT_SNAPLEN "-s" // Followed by max number of payload bytes to display
+#define OPT_ASCII "-a" // Display ASCII column alongside payload hex
+#define OPT_HEADERS_ONLY "-H" // Only display headers, payload is skipped
+#define OPT_GREP_STR "-g" // Followed by string pattern to search payloads for
+#define OPT_GREP_HEX "-x" // Followed by hex byte pattern to search payloads for
+#define OPT_STATS "-S" // Print decoding statistics to stderr when finished
+#define OPT_SAMPLE_NTH "-n" // Followed by N, decode 1 in every N frames
+#define OPT_SAMPLE_FLOW "-F" // Followed by N, decode every frame of 1 in N flows
+#define OPT_RATE_LIMIT "-r" // Followed by max frames decoded per second of capture time
+#define OPT_TOP_N "-T" // Followed by N, print top N talkers instead of decoding frames
+#define OPT_HH_BUDGET "-M" // Followed by memory budget of top talker sketches in KB
+#define OPT_THREADS "-j" // Followed by number of threads counting top talkers
+#define OPT_DEDUP "-D" // Followed by window in ms, suppress duplicate frames within window
+#define OPT_BENCH "-B" // Followed by iterations, benchmark per-packet against batch decoding
+#define OPT_WRITE "-w" // Followed by path, write selected frames to pcap instead of displaying them
+#define OPT_SPLIT "-W" // Followed by directory, write selected frames to one pcap per flow
+#define OPT_FOLLOW "-f" // Keep decoding records appended to capture, across rotation, until interrupted
+#define OPT_ANONYMIZE "-A" // Followed by 64 hex digit key, anonymize IPv4 addresses keeping shared prefixes, frames not IPv4 are dropped
+#define NO_SNAPLEN -1 // Snap length value meaning payload is not capped
+
+// Fixed header offsets used to locate payload without decoding headers
+#define ETH_HDR_LEN 14 // Length of Ethernet header
+#define TCP_DATA_OFS_POS 12 // Position of data offset byte within TCP header
+#define HDR_WORD_LEN 4 // IP and TCP header lengths are counted in 4-byte words
+
+// Payload Search Format
+#define MATCH_LBL "\n\nPayload Matches:\n----------------"
+#define MATCH_OFS_LBL "\nPayload offset %ld:\t\t" // Offset of first byte of match
+#define MATCH_STR_FMT "\"%s\"" // Display format of string patterns
+#define MATCH_HEX_FMT "0x%s" // Display format of hex patterns
+
+// Payload Search Automaton
+#define AC_ROOT 0 // State with no bytes of any pattern matched
+#define AC_MAX_STATES 65535 // States must fit in 16-bit transition table entries
+#define AC_NO_PATTERN -1 // Marks end of pattern lists and output links
+#define AC_SSE2_MAX_FIRST 4 // Max distinct first bytes compared directly with SSE2
+#define AC_VEC_WIDTH 16 // Bytes tested per prefilter vector step
+#define AC_PREFILTER_MAX_FIRST 64 // Most distinct first bytes for which skipping ahead pays
+
+// pcap Capture Format
+#define PCAP_MAGIC_US 0xa1b2c3d4 // Magic number of captures with microsecond timestamps
+#define PCAP_MAGIC_NS 0xa1b23c4d // Magic number of captures with nanosecond timestamps
+#define PCAP_MAGIC_US_SWAP 0xd4c3b2a1 // Microsecond magic number written little-endian
+#define PCAP_MAGIC_NS_SWAP 0x4d3cb2a1 // Nanosecond magic number written little-endian
+#define PCAP_GLOBAL_HDR_LEN 24 // Length of header at start of capture
+#define PCAP_RECORD_HDR_LEN 16 // Length of header before each frame
+#define FRAME_LBL "Frame #%lu\n================\n" // Printed before each captured frame
+#define FRAME_DELIM "\n\n" // Separates frames of a capture
+
+// pcap Capture Writer
+#define PCAP_VERSION 0x00020004 // Major and minor version written in synthesized header
+#define PCAP_SNAPLEN 65535 // Snap length written in synthesized header
+#define PCAP_LINKTYPE_ETHERNET 1 // Link type written in synthesized header
+#define PCAP_BUF_SIZE (1 << 16) // Bytes buffered for each open output capture
+#define PCAP_BUF_ALIGN 4096 // Alignment of output capture buffers
+#define PCAP_MAX_OPEN 128 // Most output captures open at once, bounds descriptors and buffer memory
+#define PCAP_MIN_BUCKETS 1024 // Initial flow table buckets, power of 2
+#define PCAP_NO_FLOW -1 // Marks end of flow chains and LRU list
+#define PCAP_PATH_LEN 1024 // Buffer length of flow capture paths
+#define PCAP_FLOW_NAME "%s/%u.%u.%u.%u_%u-%u.%u.%u.%u_%u-%u.pcap" // Directory, lower endpoint, higher endpoint, protocol
+#define PCAP_OTHER_NAME "%s/other.pcap" // Capture of frames not IPv4
+
+// Follow Mode
+#define FOLLOW_POLL_MS 50 // Interval capture is checked at without inotify
+#define FOLLOW_RECHECK_MS 1000 // Longest inotify wait before capture is checked anyway
+#define FOLLOW_EVENT_BUF 4096 // Bytes of inotify events drained per read
+#define FOLLOW_PATH_LEN 1024 // Buffer length of directory holding followed capture
+#define FOLLOW_FILE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) // Changes to capture
+#define FOLLOW_DIR_EVENTS (IN_CREATE | IN_MOVED_TO) // Replacement capture appearing in directory
+
+// Address Anonymization
+#define ANON_KEY_LEN 32 // Bytes of key, AES key followed by block encrypted into pad
+#define ANON_CACHE_SIZE 4096 // Recent address and prefix mappings cached, power of 2
+#define ANON_PREFIX_BITS 24 // Leading anonymized bits cached per prefix, multiple of ANON_LANES
+#define ANON_LANES 8 // Blocks encrypted together with AES-NI, divides 32
+#define ANON_PATCH_LEN (ETH_HDR_LEN + IP_MAX_HDR_LEN + TCP_CHECKSUM_POS + 2) // Leading frame bytes rewritten
+#define AES_BLOCK_LEN 16 // Bytes in AES block and in each round key
+#define AES_ROUNDS 10 // Rounds of AES-128
+#define IP_MAX_HDR_LEN 60 // Length of IP header with most options
+#define IP_FRAG_POS 6 // Position of flags and fragment offset within IP header
+#define TCP_CHECKSUM_POS 16 // Position of checksum within TCP header
+#define UDP_CHECKSUM_POS 6 // Position of checksum within UDP header, 0 when unused
+
+// Frame Sampling
+#define FLOW_PEEK_LEN (ETH_HDR_LEN + 64) // Frame bytes read to find flow of a frame
+#define IP_PROTO_POS 9 // Position of protocol field within IP header
+#define IP_SRC_POS 12 // Position of source address within IP header
+#define IP_DEST_POS 16 // Position of destination address within IP header
+#define ETH_TYPE_POS 12 // Position of type field within Ethernet header
+#define ETH_TYPE_IPV4 0x0800 // Type field value of IPv4 frames
+#define IP_PROTO_TCP 6 // Protocol field value of TCP segments
+#define IP_PROTO_UDP 17 // Protocol field value of UDP datagrams
+#define IP_MIN_HDR_LEN 20 // Length of IP header without options
+#define IP_TTL_POS 8 // Position of time to live field within IP header
+#define IP_CHECKSUM_POS 10 // Position of 2-byte checksum within IP header
+
+#define TCP_MIN_HDR_LEN 20 // Length of TCP header without options
+#define TCP_MAX_HDR_LEN 60 // Length of TCP header with most options
+#define FRAME_HDR_MAX_LEN (ETH_HDR_LEN + IP_MAX_HDR_LEN + TCP_MAX_HDR_LEN) // Frame bytes read to render headers
+
+// Batch Decoding
+#define BATCH_SIZE 64 // Frames decoded together into field columns
+#define BATCH_VEC_WIDTH 8 // Frames decoded per vector step
+#define BENCH_MAX_FRAMES 4096 // Most frames loaded for benchmark
+#define BENCH_LBL "Decode Benchmark:\n----------------\nFrames:\t\t\t\t%d x %lu iterations"
+#define BENCH_PER_PACKET_LBL "\nPer-packet decode:\t\t%.2f Mframes/s"
+#define BENCH_BATCH_LBL "\nBatch decode (%s):\t%.2f Mframes/s"
+#define BENCH_SCHEMA_LBL "\nSchema decode:\t\t\t%.2f Mframes/s"
+#define BENCH_MATCH_LBL "\nColumns match:\t\t\t%s"
+#define BENCH_MATCH "yes"
+#define BENCH_MISMATCH "NO"
+
+// Duplicate Frame Suppression
+#define DEDUP_RING_SIZE 4096 // Most recent fingerprints kept, power of 2
+#define DEDUP_BUCKETS 1024 // Fingerprint index buckets, power of 2
+#define DEDUP_WAYS 4 // Fingerprints indexed per bucket
+#define DEDUP_CHUNK_LEN 4096 // Frame bytes hashed per read, multiple of 8
+
+// Heavy Hitters (Top Talkers)
+#define HH_DEFAULT_BUDGET_KB 1024 // Sketch memory of each thread when not given
+#define HH_NUM_CATEGORIES 4 // Sources, destinations, ports and address pairs
+#define HH_NUM_METRICS 2 // Packets and bytes
+#define HH_DEPTH 4 // Rows of each Count-Min sketch
+#define HH_MIN_WIDTH 64 // Fewest counters in a Count-Min row
+#define HH_SLOT_EMPTY -1 // Marks unused summary hash slot
+#define HH_CHUNK_RECORDS 4096 // Records in each unit of work split between threads
+#define HH_MAX_THREADS 64 // Most threads counting top talkers
+#define HH_KEY_LEN 40 // Buffer length of formatted key
+#define HH_TABLE_DELIM "\n\n" // Separates top talker tables
+#define HH_LBL "Top %d %s by %s:\n----------------" // Heading of each table
+#define HH_ROW_FMT "\n%d.\t%-32s%llu" // Rank, key and count of each row
+#define HH_PAIR_FMT "%u.%u.%u.%u -> %u.%u.%u.%u" // Key format of address pairs
+#define HH_ADDR_FMT "%u.%u.%u.%u" // Key format of addresses
+#define HH_PORT_FMT "%u" // Key format of ports
+#define HH_CATEGORY_NAMES {"source addresses", "destination addresses", "ports", "address pairs"}
+#define HH_METRIC_NAMES {"packets", "bytes"}
+
+#define OUT_BUF_SIZE (1 << 20) // Bytes in each output buffer
+#define OUT_NUM_BUFS 4 // Buffers cycled between decoder and writer, bounds queued output
+#define OUT_FD 1 // File descriptor of standard output
+
+// Statistics Format, printed to stderr
+#define STATS_LBL "\nDecode Statistics:\n----------------"
+#define STATS_OUT_WAITS_LBL "\nOutput waits:\t\t\t%lu"
+#define STATS_OUT_WAIT_MS_LBL "\nOutput wait time:\t\t%.3f ms"
+#define STATS_FRAMES_LBL "\nFrames read:\t\t\t%lu"
+#define STATS_SAMPLED_LBL "\nFrames sampled:\t\t\t%lu"
+#define STATS_SKIPPED_LBL "\nFrames skipped by sampling:\t%lu"
+#define STATS_DUPLICATES_LBL "\nDuplicate frames suppressed:\t%lu"
+#define STATS_WRITTEN_LBL "\nFrames written:\t\t\t%lu"
+#define STATS_CAPTURES_LBL "\nCaptures written:\t\t%d"
+#define STATS_ANON_DROPPED_LBL "\nFrames dropped, not IPv4:\t%lu"
+#define STATS_ANON_LBL "\nAddresses anonymized (%s):\t%lu"
+#define STATS_ANON_HITS_LBL "\nAnonymization cache hits:\t%lu"
+#define STATS_ANON_PREFIX_LBL "\nAnonymization prefix hits:\t%lu"
 
 // Error Codes
 #define ERR_FILE_NOT_FOUND 1 // File arg missing
 #define ERR_FILE_NOT_OPEN 2 // File failed to open
+#define ERR_BAD_OPTION 3 // Unrecognized or malformed option
+#define ERR_NO_MEMORY 4 // Memory allocation failed
+#define ERR_TOO_MANY_PATTERNS 5 // Search patterns exceed automaton state limit
+#define ERR_HH_BUDGET 6 // Sketch memory budget too small for requested top N
+#define ERR_WRITE_FAILED 7 // Output capture could not be opened or written
 
 // Error Messages
 #define MSG_FILE_NOT_FOUND "\nError: A path to a .bin containing Ethernet " \
-                           " packet data is required. \n Run with `./PacketDecode <path>`"
+                           " packet data or a .pcap capture is required. \n Run with `./PacketDecode <path>`"
 #define MSG_FILE_NOT_OPEN "\nError: File argument could not be opened"
+#define MSG_BAD_OPTION "\nError: Unrecognized or malformed option. \n Run with " \
+                       "`./PacketDecode <path> [-s <snaplen>] [-a] [-H] [-S] " \
+                       "[-g <string>]... [-x <hex bytes>]... [-n <N>] [-F <N>] [-r <pps>] " \
+                       "[-D <window ms>] [-T <N> [-M <KB>] [-j <threads>]] [-B <iterations>] " \
+                       "[-w <out.pcap> | -W <directory>] [-f] [-A <64 hex digit key>]`"
+#define MSG_NO_MEMORY "\nError: Memory allocation failed"
+#define MSG_TOO_MANY_PATTERNS "\nError: Search patterns are too long to build automaton"
+#define MSG_HH_BUDGET "\nError: Sketch memory budget is too small to track requested top talkers"
+#define MSG_WRITE_FAILED "\nError: Output capture could not be opened or written"
 
 // Bit masks to check specific bit in byte
 #define BIT_MASK_0 1
@@ -91,249 +398,984 @@
 #define BIT_MASK_5 32
 
 
+// Decoded header fields, one member per schema field
+typedef struct { ETH_FIELDS(DECLARE_FIELD, EthHeader) } EthHeader;
+typedef struct { IP_FIELDS(DECLARE_FIELD, IPHeader) } IPHeader;
+typedef struct { TCP_FIELDS(DECLARE_FIELD, TCPHeader) } TCPHeader;
+
+// Output modes selecting which packet segments are rendered
+typedef enum {
+    OUT_MODE_FULL, // Headers and payload
+    OUT_MODE_HEADERS // Headers only, payload is skipped without being read
+} OutputMode;
+
+// Byte pattern searched for in payloads
+typedef struct {
+    const uint8_t* bytes; // Bytes to match
+    int len; // Number of bytes in pattern
+    const char* label; // Argument pattern was parsed from
+    int isHex; // Non-zero if parsed from hex argument
+} SearchPattern;
+
+// Decoding options parsed from command-line arguments
+typedef struct {
+    const char* path; // Path to packet data file
+    long snapLen; // Max payload bytes rendered, NO_SNAPLEN for no limit
+    int showAscii; // Non-zero to display ASCII column beside payload hex
+    OutputMode mode; // Selects which packet segments are rendered
+    SearchPattern* patterns; // Payload search patterns, only matching packets are shown
+    int numPatterns; // Number of search patterns, 0 when not searching
+    int showStats; // Non-zero to print statistics to stderr when finished
+    unsigned long sampleNth; // Decode 1 in every sampleNth frames, 0 to decode all
+    unsigned long sampleFlows; // Decode frames of 1 in sampleFlows flows, 0 for all flows
+    double rateLimit; // Max frames decoded per second of capture time, 0 for no limit
+    unsigned long topN; // Top talkers printed per table, 0 to decode frames instead
+    unsigned long budgetKB; // Memory budget of each thread's top talker sketches
+    unsigned long threads; // Threads counting top talkers
+    double dedupWindow; // Seconds duplicate frames are suppressed for, 0 to keep duplicates
+    unsigned long benchIters; // Benchmark iterations, 0 to decode frames instead
+    const char* writePath; // Capture selected frames are written to, NULL to display frames
+    const char* splitDir; // Directory of one capture per flow, NULL when not splitting
+    int follow; // Non-zero to keep decoding records as capture grows
+    int anonymize; // Non-zero to anonymize addresses printed and written
+    uint8_t anonKey[ANON_KEY_LEN]; // Key anonymized addresses are derived from
+} DecodeOptions;
+
+// Layout of capture file
+typedef struct {
+    int isPcap; // Non-zero for pcap capture, zero for file holding one raw frame
+    int swapped; // Non-zero if header fields are little-endian
+    int nanoTime; // Non-zero if timestamp fractions are nanoseconds
+} CaptureInfo;
+
+// Header of one captured frame
+typedef struct {
+    double time; // Capture time in seconds
+    long len; // Bytes of frame data following header
+} CaptureRecord;
+
+// State of sampling decisions across frames
+typedef struct {
+    unsigned long counter; // Frames considered by 1 in N sampler
+    double tokens; // Frames rate limit currently allows
+    double lastTime; // Capture time of previous frame reaching rate limit
+    int started; // Non-zero once rate limit has seen a frame
+} SamplerState;
+
+// Protocol, addresses and ports read from fixed offsets of IPv4 frame
+typedef struct {
+    uint32_t srcIP; // Source IP address
+    uint32_t destIP; // Destination IP address
+    uint16_t srcPort; // Source port, 0 without ports
+    uint16_t destPort; // Destination port, 0 without ports
+    uint8_t protocol; // IP protocol field
+    int hasPorts; // Non-zero for TCP and UDP
+} FlowFields;
+
+// Categories of keys counted as top talkers
+enum { HH_SOURCES, HH_DESTINATIONS, HH_PORTS, HH_PAIRS };
+
+// Metrics top talkers are ranked by
+enum { HH_PACKETS, HH_BYTES };
+
+// Key tracked in top talker summary
+typedef struct {
+    uint64_t key; // Address, port or address pair
+    uint64_t count; // Estimated packets or bytes, never below true count
+    int32_t slot; // Hash slot holding entry's heap position
+} HHEntry;
+
+// Space-Saving summary of heaviest keys for one metric
+// Keys live in min-heap by count, hash slots locate each key's heap position
+typedef struct {
+    HHEntry* heap; // Tracked keys, lightest first
+    int32_t* slots; // Heap position of key hashed to each slot, HH_SLOT_EMPTY if unused
+    int size; // Keys tracked
+    int capacity; // Max keys tracked
+    uint32_t slotMask; // Number of slots minus one
+} HHSummary;
+
+// Count-Min sketch of packets and bytes for one category of keys
+typedef struct {
+    uint64_t* cells; // HH_DEPTH rows of width x HH_NUM_METRICS counters
+    uint32_t widthMask; // Counters per row minus one
+} CMSketch;
+
+// Top talker sketches of one thread, merged when threads finish
+typedef struct {
+    CMSketch sketch[HH_NUM_CATEGORIES]; // Estimated totals of every key
+    HHSummary top[HH_NUM_CATEGORIES][HH_NUM_METRICS]; // Heaviest keys
+} HeavyHitters;
+
+// Header fields of a batch of frames, one array per field
+typedef struct {
+    uint8_t ttl[BATCH_SIZE]; // IP time to live
+    uint8_t proto[BATCH_SIZE]; // IP protocol
+    uint32_t srcIP[BATCH_SIZE]; // IP source address
+    uint32_t destIP[BATCH_SIZE]; // IP destination address
+    uint16_t srcPort[BATCH_SIZE]; // TCP source port
+    uint16_t destPort[BATCH_SIZE]; // TCP destination port
+    uint8_t tcpFlags[BATCH_SIZE]; // TCP flags byte
+    uint8_t valid[BATCH_SIZE]; // Non-zero for IPv4 frames long enough to hold TCP header
+    int count; // Frames in batch
+} FieldColumns;
+
+// Fingerprint of recent frame
+typedef struct {
+    uint64_t fingerprint; // Hash of frame bytes which do not change between copies
+    double time; // Capture time of frame
+} DedupRecord;
+
+// Index entry locating fingerprint in ring
+typedef struct {
+    uint32_t tag; // High half of fingerprint
+    uint32_t seq; // Ring sequence number plus one, 0 if unused
+} DedupSlot;
+
+// Time-windowed ring of recent fingerprints with set-associative index
+// Index entries of overwritten ring records become stale and are ignored
+typedef struct {
+    DedupRecord* ring; // Most recent fingerprints, oldest overwritten first
+    DedupSlot* index; // DEDUP_BUCKETS x DEDUP_WAYS ring positions
+    uint32_t seq; // Sequence number of next ring record
+} DedupState;
+
+// Frame counts reported with statistics
+typedef struct {
+    unsigned long frames; // Frames read from capture
+    unsigned long sampled; // Frames passing sampling
+    unsigned long skipped; // Frames skipped by sampling
+    unsigned long duplicates; // Sampled frames suppressed as duplicates
+    unsigned long anonDropped; // Frames not displayed since anonymizer cannot rewrite their addresses
+} FrameCounts;
+
+// Buffers output and hands full buffers to writer thread
+// Decoder fills one buffer while writer drains those queued before it
+typedef struct {
+    char* bufs[OUT_NUM_BUFS]; // Output buffers, cycled in order
+    size_t lens[OUT_NUM_BUFS]; // Bytes held in each buffer
+    int fillIdx; // Buffer being filled by decoder
+    int drainIdx; // Next buffer drained by writer
+    int queued; // Buffers handed to writer and not yet drained
+    int closing; // Set once no more buffers will be queued
+    int threaded; // Non-zero while writer thread is running
+    int splicePipe; // Non-zero when output is a pipe pages can be spliced into
+    unsigned long waits; // Times decoder waited for writer to free a buffer
+    double waitMs; // Total time decoder spent waiting
+#ifdef OUT_ASYNC
+    pthread_t writer; // Drains queued buffers
+    pthread_mutex_t lock; // Guards queue state
+    pthread_cond_t ready; // Signalled when buffer queued or sink closing
+    pthread_cond_t space; // Signalled when buffers drained
+#endif
+} OutputSink;
+
+static OutputSink outSink; // Sink all standard output is written through
+
+#ifdef HAVE_FOLLOW
+static volatile sig_atomic_t followStopped; // Set by SIGINT or SIGTERM to end follow mode
+#endif
+
+// Aho-Corasick automaton matching all search patterns in one pass
+// Bytes appearing in no pattern share transition column 0 to keep table compact
+typedef struct {
+    uint16_t byteClass[256]; // Maps each byte to its transition table column, 257 columns when every byte is used
+    int numClasses; // Number of transition table columns
+    int numStates; // Number of automaton states
+    uint16_t* next; // numStates x numClasses table of next states
+    int32_t* match; // First pattern ending at each state, AC_NO_PATTERN if none
+    int32_t* outLink; // Nearest suffix state with a match, AC_NO_PATTERN if none
+    int32_t* patNext; // Next pattern ending at same state as each pattern
+    uint8_t* reports; // Non-zero for states where any pattern ends
+    uint8_t isFirst[256]; // Non-zero for bytes that begin a pattern
+    uint8_t firstBytes[AC_SSE2_MAX_FIRST]; // Distinct first bytes when few enough
+    int numFirst; // Number of distinct first bytes
+    int prefilter; // Non-zero if first bytes are few enough to skip ahead to
+    uint8_t loMask[16]; // Prefilter buckets for each low nibble
+    uint8_t hiMask[16]; // Prefilter bucket for each high nibble
+} SearchAutomaton;
+
+// Location of a pattern found in a payload
+typedef struct {
+    long offset; // Payload offset of first byte of match
+    int pattern; // Index of matched pattern
+} SearchMatch;
+
+// Matches found in current packet
+typedef struct {
+    SearchMatch* items; // Stored matches
+    int count; // Number of stored matches
+    int capacity; // Allocated match slots
+} SearchResults;
+
+// Output capture of one flow
+// Open captures hold a buffer and sit on LRU list, closed ones are reopened for append
+typedef struct {
+    FlowFields key; // Flow with lower endpoint first
+    int isOther; // Non-zero for capture of frames not IPv4
+    int created; // Non-zero once capture file is created with global header
+    int32_t next; // Next flow in same bucket, PCAP_NO_FLOW at end of chain
+    int32_t newer; // Next more recently written open capture
+    int32_t older; // Next less recently written open capture
+    FILE* file; // Open capture, NULL while closed
+    uint8_t* buf; // Records not yet written, NULL while closed
+    size_t len; // Bytes held in buffer
+} PcapFlow;
+
+// Copies selected frames unchanged into one capture or one capture per flow
+// Flows live in chained hash table, at most PCAP_MAX_OPEN captures are open at once
+typedef struct {
+    const char* path; // Single output capture, NULL when splitting
+    const char* dir; // Directory of flow captures, NULL when writing one capture
+    uint8_t header[PCAP_GLOBAL_HDR_LEN]; // Global header starting every output capture
+    int isPcap; // Non-zero if input records have headers to copy
+    int swapped; // Non-zero if input header fields are little-endian
+    PcapFlow* flows; // Every flow seen
+    int numFlows; // Flows in use
+    int capacity; // Flows allocated
+    int32_t* buckets; // First flow of each hash chain
+    uint32_t bucketMask; // Number of buckets minus one
+    int32_t newest; // Most recently written open capture
+    int32_t oldest; // Least recently written open capture, evicted first
+    int numOpen; // Captures currently open
+    int maxOpen; // Most captures kept open, lowered if descriptors run out first
+    unsigned long written; // Frames written
+    unsigned long dropped; // Frames not written since anonymizer cannot rewrite their addresses
+} PcapWriter;
+
+// Watches followed capture for appended records and replacement
+typedef struct {
+    const char* path; // Path capture is followed at
+    int notifyFd; // inotify instance, -1 when polling
+    int fileWatch; // Watch of file currently at path
+} FollowState;
+
+// Expanded AES-128 key
+typedef struct {
+    uint8_t roundKeys[AES_BLOCK_LEN * (AES_ROUNDS + 1)]; // Key added in each round, in order
+} AESKey;
+
+// Mapping of recently anonymized address or prefix
+typedef struct {
+    uint32_t addr; // Original address, or prefix shifted down
+    uint32_t anon; // Anonymized address, or pad bits of prefix
+} AnonEntry;
+
+// Crypto-PAn prefix-preserving anonymizer
+// Addresses sharing their first N bits map to addresses sharing their first N bits
+typedef struct {
+    int enabled; // Non-zero once key is set
+    AESKey aes; // Pseudorandom function anonymized bits are drawn from
+    uint8_t pad[AES_BLOCK_LEN]; // Encrypted second half of key, fills block past address prefix
+    uint32_t padWord; // First 4 bytes of pad as big-endian value
+    AnonEntry cache[ANON_CACHE_SIZE]; // Direct-mapped recent address mappings
+    AnonEntry prefixes[ANON_CACHE_SIZE]; // Direct-mapped pad bits of recent ANON_PREFIX_BITS prefixes
+    unsigned long lookups; // Addresses anonymized
+    unsigned long hits; // Lookups answered from address cache
+    unsigned long prefixHits; // Missed lookups whose prefix bits were cached
+} IPAnonymizer;
+
+static IPAnonymizer ipAnon; // Anonymizes addresses printed and written, shared like outSink
+
+// State shared by every frame decoded from one capture
+typedef struct {
+    const DecodeOptions* opts; // Options parsed from arguments
+    CaptureInfo capture; // Layout of capture being decoded
+    SearchAutomaton ac; // Matches search patterns against payloads
+    SearchResults results; // Pattern matches in current packet
+    uint8_t* frameBuf; // Frame bytes read for searching, reused across frames
+    long frameBufLen; // Bytes allocated for frameBuf
+    SamplerState sampler; // Sampling decisions so far
+    DedupState dedup; // Fingerprints of recent frames
+    FrameCounts counts; // Frames read and sampled so far
+    unsigned long framesShown; // Frames displayed so far
+    PcapWriter writer; // Output captures of selected frames
+} DecodeContext;
+
+// Thread counting one run of capture records into its own sketches
+typedef struct {
+    DecodeContext ctx; // Own sampler, counts and search results, shared options
+    HeavyHitters hh; // Sketches of records counted by this thread
+    long start; // Offset of first record counted
+    long maxRecords; // Records counted, negative to count until end of capture
+    long fileEnd; // Records must end before this offset
+    int started; // Non-zero if running on its own thread
+    int errCode; // First error encountered
+#ifdef HAVE_PTHREADS
+    pthread_t thread; // Thread counting records
+#endif
+} HHWorker;
+
+
+// Functions to buffer and write output
+int outOpen(OutputSink* sink);
+void outClose(OutputSink* sink);
+void outPrintf(const char* format, ...);
+void outWrite(const char* data, size_t len);
+static inline void outPutc(int c);
+static void outSubmit(OutputSink* sink);
+static void outDrain(OutputSink* sink, int first, int count);
+static inline char* outAllocBuf(void);
+static inline void outFreeBuf(char* buf);
+#ifdef OUT_ASYNC
+static void* outWriterMain(void* arg);
+static inline double monotonicMs(void);
+#endif
+void printStats(const OutputSink* sink, const DecodeContext* ctx);
+
+// Functions to track top talkers in fixed memory
+int topTalkers(FILE* packetData, DecodeContext* ctx);
+int indexCapture(FILE* packetData, const CaptureInfo* info, long fileEnd,
+                 long** chunkStarts, long* numChunks);
+static void* hhWorkerMain(void* arg);
+int hhInit(HeavyHitters* hh, unsigned long budgetKB, unsigned long topN);
+void hhFree(HeavyHitters* hh);
+void hhAddFrame(HeavyHitters* hh, const FlowFields* fields, long frameLen);
+static inline void hhAdd(HeavyHitters* hh, int category, uint64_t key, long frameLen);
+void hhMerge(HeavyHitters* dest, const HeavyHitters* src);
+static inline void cmAdd(CMSketch* sketch, uint64_t key, const uint64_t* weights, uint64_t* estimates);
+static inline uint64_t cmEstimate(const CMSketch* sketch, uint64_t key, int metric);
+static void ssOffer(HHSummary* summary, uint64_t key, uint64_t weight, uint64_t estimate);
+static inline int32_t ssFindSlot(const HHSummary* summary, uint64_t key);
+static void ssRemoveSlot(HHSummary* summary, int32_t slot);
+static void ssSiftDown(HHSummary* summary, int pos);
+static void ssSiftUp(HHSummary* summary, int pos);
+static inline void ssSwap(HHSummary* summary, int a, int b);
+static int compareEntries(const void* a, const void* b);
+void printTopTalkers(const HeavyHitters* hh, unsigned long topN);
+
 // Helper functions for reading and printing data
-static inline int printBytes(FILE* file, int numBytes, const char* delim);
-static inline uint8_t printByteSafe(FILE* file);
 static inline uint32_t readUIntBE(FILE* data, int nBytes);
+static inline long fileSize(FILE* file);
+static inline uint32_t readCaptureUInt(FILE* data, const CaptureInfo* info);
+void readCaptureHeader(FILE* packetData, CaptureInfo* info);
+int readCaptureRecord(FILE* packetData, const CaptureInfo* info, long fileEnd, CaptureRecord* record);
+static inline int parseCount(const char* arg, unsigned long* count);
+int parseOptions(int argc, char* argv[], DecodeOptions* opts);
+void freeOptions(DecodeOptions* opts);
+static inline int parseHexPattern(const char* hex, SearchPattern* pattern);
+
+// Functions to search payloads for patterns
+int buildAutomaton(SearchAutomaton* ac, const SearchPattern* patterns, int numPatterns);
+void freeAutomaton(SearchAutomaton* ac);
+static inline long prefilterSkip(const SearchAutomaton* ac, const uint8_t* data, long pos, long len);
+#if defined(AC_SHUFFLE)
+AC_TARGET static long prefilterSkipShuffle(const SearchAutomaton* ac, const uint8_t* data, long pos, long len);
+#endif
+int searchPayload(const SearchAutomaton* ac, const SearchPattern* patterns,
+                  const uint8_t* data, long len, SearchResults* results);
+int searchFrame(FILE* packetData, long frameLen, DecodeContext* ctx);
+static inline long payloadOffset(const uint8_t* frame, long frameLen, long* ipLen, long* tcpLen);
+void printMatches(const SearchResults* results, const DecodeOptions* opts);
 
 // Functions to parse and display packet segments
-void printEthernetHeader(FILE* packetData);
-void printIPHeader(FILE* packetData);
-void printTCPHeader(FILE* packetData);
-static inline void printIPOptions(FILE* packetData, int numOptions);
-int printPayload(FILE* packetData);
+void printEthernetHeader(const uint8_t* raw);
+void printIPHeader(const uint8_t* raw);
+void printTCPHeader(const uint8_t* raw);
+static inline void printIPOptions(const uint8_t* options, int numOptions);
+void printIPAddress(uint32_t address);
+static inline uint64_t readBitsBE(const uint8_t* data, int numBytes);
+static inline void renderMAC(const char* label, uint64_t address);
+static inline void renderIPv4(const char* label, uint64_t address);
+static inline void renderHex2(const char* label, uint64_t value);
+static inline void renderHex4(const char* label, uint64_t value);
+static inline void renderDec(const char* label, uint64_t value);
+static inline void renderECN(const char* label, uint64_t ecn);
+static inline void renderFragFlags(const char* label, uint64_t flags);
+static inline void renderTCPFlags(const char* label, uint64_t flags);
+static inline void printPayloadRow(const uint8_t* row, int rowBytes, int showAscii);
+long printPayload(FILE* packetData, long payloadLen, const DecodeOptions* opts);
+int decodeFrame(FILE* packetData, long frameLen, DecodeContext* ctx);
+int decodeRecords(FILE* packetData, long fileEnd, DecodeContext* ctx);
+int decodeCapture(FILE* packetData, DecodeContext* ctx);
+
+// Functions to sample frames before decoding
+int sampleFrame(FILE* packetData, long frameLen, double time, DecodeContext* ctx);
+static inline int peekFlowFields(FILE* packetData, long frameLen, FlowFields* fields);
+static inline uint64_t flowHash(FILE* packetData, long frameLen);
+static inline uint64_t mixBits(uint64_t value);
+
+// Functions to decode batches of frames into field columns
+void decodeBatch(const uint8_t* arena, const int32_t* offsets, const int32_t* lengths,
+                 int count, FieldColumns* cols);
+static inline int batchFrameValid(const uint8_t* frame, int32_t len);
+static inline void decodeBatchFrame(const uint8_t* frame, FieldColumns* cols, int idx);
+static inline void decodeSchemaFrame(const uint8_t* frame, FieldColumns* cols, int idx);
+#if defined(BATCH_VECTOR)
+BATCH_TARGET static int decodeBatchVector(const uint8_t* arena, const int32_t* offsets, const int32_t* lengths,
+                                          int count, FieldColumns* cols);
+BATCH_TARGET static inline __m256i loadFramePair(const uint8_t* first, const uint8_t* second, __m256i pick);
+#endif
+static inline uint64_t columnChecksum(const FieldColumns* cols, int count);
+int benchmarkDecode(FILE* packetData, DecodeContext* ctx);
+
+// Functions to suppress duplicate frames
+int dedupInit(DedupState* dedup);
+void dedupFree(DedupState* dedup);
+int isDuplicate(FILE* packetData, long frameLen, double time, DecodeContext* ctx);
+static inline uint64_t frameFingerprint(FILE* packetData, long frameLen);
+
+// Functions to write selected frames to pcap captures
+int pcapOpen(PcapWriter* writer, const DecodeOptions* opts, FILE* packetData, const CaptureInfo* info);
+int pcapClose(PcapWriter* writer);
+int pcapWriteFrame(PcapWriter* writer, FILE* packetData, long frameLen);
+static int pcapFindFlow(PcapWriter* writer, FILE* packetData, long frameLen, int32_t* flowIdx);
+static void pcapRehash(PcapWriter* writer);
+static inline uint32_t pcapFlowHash(const FlowFields* key);
+static int pcapOpenFlow(PcapWriter* writer, int32_t idx);
+static int pcapCloseFlow(PcapWriter* writer, int32_t idx);
+static inline int pcapFlush(PcapFlow* flow);
+static inline void pcapUnlink(PcapWriter* writer, int32_t idx);
+static inline void pcapLinkNewest(PcapWriter* writer, int32_t idx);
+static inline void pcapPutUInt(uint8_t* dest, uint32_t value, int swapped);
+static inline uint8_t* pcapAllocBuf(void);
+static inline void pcapFreeBuf(uint8_t* buf);
+int pcapSync(PcapWriter* writer);
+
+// Functions to follow captures as they are written
+#ifdef HAVE_FOLLOW
+void followInit(FollowState* follow, const char* path);
+void followFree(FollowState* follow);
+int followNext(FollowState* follow, FILE* packetData, long fileEnd, CaptureInfo* info);
+static int followHeader(FollowState* follow, FILE* packetData);
+static int followReopen(FollowState* follow, FILE* packetData);
+static int followWait(FollowState* follow);
+static void followStop(int signum);
+#endif
+
+// Functions to anonymize addresses preserving prefixes
+void anonInit(IPAnonymizer* anon, const uint8_t* key);
+static inline uint32_t anonymizeIP(IPAnonymizer* anon, uint32_t addr);
+static uint32_t anonPadBits(const IPAnonymizer* anon, uint32_t addr, int firstBit, int endBit);
+#if defined(ANON_AESNI)
+ANON_TARGET static uint32_t anonPadBitsAESNI(const IPAnonymizer* anon, uint32_t addr, int firstBit, int endBit);
+#endif
+void anonymizeFrame(IPAnonymizer* anon, uint8_t* frame, long len);
+static inline uint16_t checksumAdjust(uint16_t sum, uint32_t from, uint32_t to);
+static void aesExpandKey(AESKey* aes, const uint8_t* key);
+static void aesEncrypt(const AESKey* aes, const uint8_t* in, uint8_t* out);
+static inline uint8_t aesDouble(uint8_t value);
 
 
 // Run program to decode and display Ethernet packets
-// Takes path to .bin file containing one packet of data as argument
+// Takes path to .bin file containing one packet of data, or .pcap capture, as argument
+// Optional arguments after path are described by OPT_ macro constants
 int main(int argc, char *argv[]) {
     int errCode = 0; // Tracks errors
     FILE* packetData = NULL; // Pointer to input packet data
+    DecodeOptions opts; // Options parsed from arguments
+    DecodeContext ctx = {0}; // State shared across frames
+
+    if(outOpen(&outSink)) // Start output writer
+        return ERR_NO_MEMORY;
+
+    errCode = parseOptions(argc, argv, &opts); // Read command-line options
+
+    ctx.opts = &opts;
+
+    if(!errCode && opts.numPatterns > 0) // Compile search patterns
+        errCode = buildAutomaton(&ctx.ac, opts.patterns, opts.numPatterns);
+
+    if(!errCode && opts.dedupWindow > 0) // Allocate fingerprint ring
+        errCode = dedupInit(&ctx.dedup);
 
-    if(argc < 2) { // No filepath argument received
-        errCode = ERR_FILE_NOT_FOUND; // Set error code
-        printf(MSG_FILE_NOT_FOUND); // Alert user of error
+    if(!errCode && opts.anonymize) // Derive anonymizer from key
+        anonInit(&ipAnon, opts.anonKey);
+
+    if(errCode == ERR_FILE_NOT_FOUND) { // No filepath argument received
+        outPrintf(MSG_FILE_NOT_FOUND); // Alert user of error
+    } else if(errCode == ERR_BAD_OPTION) { // Option could not be parsed
+        outPrintf(MSG_BAD_OPTION); // Alert user of error
+    } else if(errCode == ERR_NO_MEMORY) { // Allocation failed
+        outPrintf(MSG_NO_MEMORY); // Alert user of error
+    } else if(errCode == ERR_TOO_MANY_PATTERNS) { // Automaton would be too large
+        outPrintf(MSG_TOO_MANY_PATTERNS); // Alert user of error
     } else { // Attempt to open binary packet data
-        packetData = fopen(argv[1], "rb"); // Open file
+        packetData = fopen(opts.path, "rb"); // Open file
 
         if(!packetData) { // Could not open file
             errCode = ERR_FILE_NOT_OPEN; // Set error code
-            printf(MSG_FILE_NOT_OPEN); // Alert user of error
+            outPrintf(MSG_FILE_NOT_OPEN); // Alert user of error
         } else { // Read file data
-            printEthernetHeader(packetData); // Process Ethernet header
-
-            printIPHeader(packetData); // Process IP header
+            if(opts.benchIters > 0) // Time decoders instead of decoding
+                errCode = benchmarkDecode(packetData, &ctx);
+            else if(opts.topN > 0) // Count frames into top talker tables
+                errCode = topTalkers(packetData, &ctx);
+            else // Decode every frame
+                errCode = decodeCapture(packetData, &ctx);
 
-            printTCPHeader(packetData); // Process TCP header
-
-            printf(PAYLOAD_LBL); // Process payload
-            printPayload(packetData);
+            if(errCode == ERR_NO_MEMORY) // Payload or sketches could not be allocated
+                outPrintf(MSG_NO_MEMORY);
+            else if(errCode == ERR_HH_BUDGET) // Sketches cannot hold top N
+                outPrintf(MSG_HH_BUDGET);
+            else if(errCode == ERR_WRITE_FAILED) // Output capture failed
+                outPrintf(MSG_WRITE_FAILED);
 
             fclose(packetData); // Close packet data file
         }
 
     }
 
-    printf("\n"); // Print trailing newline
+    outPrintf("\n"); // Print trailing newline
+    outClose(&outSink); // Write remaining output and stop writer
+
+    // Report statistics after output is complete, sampled and suppressed counts are always reported
+    if(!errCode && (opts.showStats || ctx.counts.skipped > 0 || ctx.counts.duplicates > 0))
+        printStats(&outSink, &ctx);
+
+    dedupFree(&ctx.dedup); // Release fingerprint ring
+    free(ctx.results.items); // Release search resources
+    free(ctx.frameBuf);
+    freeAutomaton(&ctx.ac);
+    freeOptions(&opts);
 
     return errCode;
 }
 
 
-// Prints specified number of bytes pointed to by `file` arg
-// Bytes are printed as individual hexadecimal values
-// Output is separated by `delim` arg
-// Does not check for end of file or error after reading bytes
-static inline int printBytes(FILE* file, int numBytes, const char* delim) {
-    uint8_t nextByte = 0; // Stores read bytes
-    int bytesRead = 0; // Tracks number of bytes read
+// Parses command-line arguments into `opts`
+// First argument not starting with '-' is taken as the packet data path
+// Returns 0 on success, ERR_FILE_NOT_FOUND or ERR_BAD_OPTION otherwise
+int parseOptions(int argc, char* argv[], DecodeOptions* opts) {
+    int idx;
+    char* end; // End of parsed numeric argument
+    SearchPattern key; // Anonymization key parsed from hex
+
+    // Set defaults
+    opts->path = NULL;
+    opts->snapLen = NO_SNAPLEN;
+    opts->showAscii = 0;
+    opts->mode = OUT_MODE_FULL;
+    opts->numPatterns = 0;
+    opts->showStats = 0;
+    opts->sampleNth = 0;
+    opts->sampleFlows = 0;
+    opts->rateLimit = 0;
+    opts->topN = 0;
+    opts->budgetKB = HH_DEFAULT_BUDGET_KB;
+    opts->threads = 1;
+    opts->dedupWindow = 0;
+    opts->benchIters = 0;
+    opts->writePath = NULL;
+    opts->splitDir = NULL;
+    opts->follow = 0;
+    opts->anonymize = 0;
+
+    // Every pattern has its own argument, so argc bounds pattern count
+    opts->patterns = malloc(argc * sizeof(SearchPattern));
+
+    if(!opts->patterns)
+        return ERR_NO_MEMORY;
+
+    for(idx = 1; idx < argc; idx++) { // Process each argument
+        if(strcmp(argv[idx], OPT_SNAPLEN) == 0) { // Payload snap length
+            if(++idx >= argc) // Missing value
+                return ERR_BAD_OPTION;
+
+            opts->snapLen = strtol(argv[idx], &end, 10);
+
+            if(*end != '\0' || opts->snapLen < 0) // Not a valid byte count
+                return ERR_BAD_OPTION;
+        } else if(strcmp(argv[idx], OPT_ASCII) == 0) { // ASCII column
+            opts->showAscii = 1;
+        } else if(strcmp(argv[idx], OPT_SAMPLE_NTH) == 0) { // 1 in N frames
+            if(++idx >= argc || parseCount(argv[idx], &opts->sampleNth))
+                return ERR_BAD_OPTION;
+        } else if(strcmp(argv[idx], OPT_SAMPLE_FLOW) == 0) { // 1 in N flows
+            if(++idx >= argc || parseCount(argv[idx], &opts->sampleFlows))
+                return ERR_BAD_OPTION;
+        } else if(strcmp(argv[idx], OPT_RATE_LIMIT) == 0) { // Frames per second cap
+            if(++idx >= argc)
+                return ERR_BAD_OPTION;
+
+            opts->rateLimit = strtod(argv[idx], &end);
+
+            if(*end != '\0' || !(opts->rateLimit > 0)) // Not a positive rate
+                return ERR_BAD_OPTION;
+        } else if(strcmp(argv[idx], OPT_TOP_N) == 0) { // Top talkers
+            if(++idx >= argc || parseCount(argv[idx], &opts->topN))
+                return ERR_BAD_OPTION;
+        } else if(strcmp(argv[idx], OPT_HH_BUDGET) == 0) { // Sketch memory
+            if(++idx >= argc || parseCount(argv[idx], &opts->budgetKB))
+                return ERR_BAD_OPTION;
+        } else if(strcmp(argv[idx], OPT_THREADS) == 0) { // Counting threads
+            if(++idx >= argc || parseCount(argv[idx], &opts->threads) || opts->threads > HH_MAX_THREADS)
+                return ERR_BAD_OPTION;
+        } else if(strcmp(argv[idx], OPT_DEDUP) == 0) { // Duplicate window
+            if(++idx >= argc)
+                return ERR_BAD_OPTION;
+
+            opts->dedupWindow = strtod(argv[idx], &end) / 1000; // Milliseconds to seconds
+
+            if(*end != '\0' || !(opts->dedupWindow > 0)) // Not a positive window
+                return ERR_BAD_OPTION;
+        } else if(strcmp(argv[idx], OPT_BENCH) == 0) { // Benchmark decoders
+            if(++idx >= argc || parseCount(argv[idx], &opts->benchIters))
+                return ERR_BAD_OPTION;
+        } else if(strcmp(argv[idx], OPT_WRITE) == 0) { // Single output capture
+            if(++idx >= argc || argv[idx][0] == '\0' || opts->splitDir)
+                return ERR_BAD_OPTION;
+
+            opts->writePath = argv[idx];
+        } else if(strcmp(argv[idx], OPT_SPLIT) == 0) { // One capture per flow
+            if(++idx >= argc || argv[idx][0] == '\0' || opts->writePath)
+                return ERR_BAD_OPTION;
 
-    // Read bytes and print
-    while(bytesRead < numBytes - 1) {
-        fread(&nextByte, 1, 1, file);
-        printf("%02x%s", nextByte& 0xFF, delim);
-        bytesRead++;
+            opts->splitDir = argv[idx];
+        } else if(strcmp(argv[idx], OPT_FOLLOW) == 0) { // Follow growing capture
+#ifdef HAVE_FOLLOW
+            opts->follow = 1;
+#else
+            return ERR_BAD_OPTION; // No way to wait for capture to grow
+#endif
+        } else if(strcmp(argv[idx], OPT_ANONYMIZE) == 0) { // Anonymize addresses
+            if(++idx >= argc || parseHexPattern(argv[idx], &key))
+                return ERR_BAD_OPTION;
+
+            if(key.len != ANON_KEY_LEN) { // Key must fill AES key and pad
+                free((void*)key.bytes);
+                return ERR_BAD_OPTION;
+            }
+
+            memcpy(opts->anonKey, key.bytes, ANON_KEY_LEN);
+            free((void*)key.bytes);
+            opts->anonymize = 1;
+        } else if(strcmp(argv[idx], OPT_STATS) == 0) { // Report statistics
+            opts->showStats = 1;
+        } else if(strcmp(argv[idx], OPT_HEADERS_ONLY) == 0) { // Skip payload
+            opts->mode = OUT_MODE_HEADERS;
+        } else if(strcmp(argv[idx], OPT_GREP_STR) == 0) { // String search pattern
+            if(++idx >= argc || argv[idx][0] == '\0') // Missing or empty pattern
+                return ERR_BAD_OPTION;
+
+            opts->patterns[opts->numPatterns].bytes = (const uint8_t*)argv[idx];
+            opts->patterns[opts->numPatterns].len = (int)strlen(argv[idx]);
+            opts->patterns[opts->numPatterns].label = argv[idx];
+            opts->patterns[opts->numPatterns].isHex = 0;
+            opts->numPatterns++;
+        } else if(strcmp(argv[idx], OPT_GREP_HEX) == 0) { // Hex byte search pattern
+            if(++idx >= argc || parseHexPattern(argv[idx], &opts->patterns[opts->numPatterns]))
+                return ERR_BAD_OPTION;
+
+            opts->numPatterns++;
+        } else if(argv[idx][0] == '-' || opts->path) { // Unknown option or extra path
+            return ERR_BAD_OPTION;
+        } else { // Packet data path
+            opts->path = argv[idx];
+        }
     }
 
-    // Print last byte without delimiter
-    fread(&nextByte, 1, 1, file);
-    printf("%02x", nextByte& 0xFF);
-    bytesRead++;
-    
-    return bytesRead;
+    return opts->path ? 0 : ERR_FILE_NOT_FOUND;
 }
 
 
-// Prints next byte pointed to by FILE* arg
-// Returns non-zero if end of file reached
-static inline uint8_t printByteSafe(FILE* file) {
-    uint8_t nextByte; // Stores byte being read
-    uint8_t bytesRead = 0; // Non-zero if byte read successful
-    
-    // attempt to read and display byte
-    if(fread(&nextByte, 1, 1, file)) {
-        printf("%02x", nextByte& 0xFF);
-        bytesRead = 1;
+// Releases memory held by options parsed with parseOptions
+void freeOptions(DecodeOptions* opts) {
+    int idx;
+
+    if(!opts->patterns) // Nothing allocated
+        return;
+
+    for(idx = 0; idx < opts->numPatterns; idx++) { // Hex patterns own their bytes
+        if(opts->patterns[idx].isHex)
+            free((void*)opts->patterns[idx].bytes);
     }
 
-    return bytesRead; 
+    free(opts->patterns);
+    opts->patterns = NULL;
+    opts->numPatterns = 0;
 }
 
 
-// Reads and prints IP address from binary file
-// File pointer must point to begining of IP Address
-// Does not check for read errors or EOF
-void printIPAddress(FILE* file) {
-    uint8_t nextByte = 0; // Stores read bytes
-    uint8_t bytesRead = 0; // Tracks number of bytes read
+// Parses string of hex digit pairs such as "deadbeef" into `pattern`
+// Returns non-zero if string is empty, has odd length or non-hex characters
+static inline int parseHexPattern(const char* hex, SearchPattern* pattern) {
+    int len = (int)strlen(hex);
+    uint8_t* bytes;
+    int idx;
+    unsigned int value;
+
+    if(len == 0 || len % 2 != 0) // Each byte needs two digits
+        return 1;
+
+    bytes = malloc(len / 2);
+
+    if(!bytes)
+        return 1;
 
-    // Read bytes and print
-    while(bytesRead < IP_ADR_LEN - 1) {
-        fread(&nextByte, 1, 1, file);
-        printf("%u.", nextByte);
-        bytesRead++;
+    for(idx = 0; idx < len / 2; idx++) { // Convert each digit pair
+        if(!isxdigit((unsigned char)hex[2 * idx]) || !isxdigit((unsigned char)hex[2 * idx + 1])
+           || sscanf(hex + 2 * idx, "%2x", &value) != 1) {
+            free(bytes);
+            return 1;
+        }
+
+        bytes[idx] = (uint8_t)value;
     }
 
-    // Print last byte without delimiter
-    fread(&nextByte, 1, 1, file);
-    printf("%u", nextByte);
+    pattern->bytes = bytes;
+    pattern->len = len / 2;
+    pattern->label = hex;
+    pattern->isHex = 1;
+
+    return 0;
 }
 
 
-// Reads and prints Ethernet Packet header from .bin file
-// packetData must already point to start of Ethernet Header data
-// Formatting and display info defined by IP Header Format macro constants at top of file
-// Does not check for read errors or EOF
-void printEthernetHeader(FILE* packetData) {
-    printf(ETHERNET_LBL); // Display packet's header
+// Parses positive decimal count from `arg` into `count`
+// Returns non-zero if `arg` is not a positive whole number
+static inline int parseCount(const char* arg, unsigned long* count) {
+    char* end; // End of parsed number
 
-    printf(MAC_DEST_LBL); // Print destination MAC address
-    printBytes(packetData, MAC_ADDR_LEN, MAC_ADDR_DELIM);
+    if(!isdigit((unsigned char)arg[0])) // Reject signs and whitespace
+        return 1;
 
-    printf(MAC_SRC_LBL); // Print Source MAC address
-    printBytes(packetData, MAC_ADDR_LEN, MAC_ADDR_DELIM);
-    
-    printf(TYPE_LBL); // Print type field
-    printBytes(packetData, TYPE_LEN, TYPE_DELIM);
+    *count = strtoul(arg, &end, 10);
+
+    return *end != '\0' || *count == 0;
 }
 
 
-// Prints specified number of IP Options from packet data
-// For each option, print macro constant defined label plus 4 bytes
-// packetData argument must point to start of IP Options data
-// Does not check for read errors or EOF
-static inline void printIPOptions(FILE* packetData, int numOptions) {
-    int optionsProcessed = 0;
-    int bytesProcessed;
-    int nextByte;
+// Reads 4-byte capture header field in byte order given by `info`
+// File pointer in data will be advanced 4 bytes on success
+// Does not check for EOF or read errors
+static inline uint32_t readCaptureUInt(FILE* data, const CaptureInfo* info) {
+    uint32_t value = readUIntBE(data, 4);
 
-    while(optionsProcessed < numOptions) { // Iterate through IP Options
-        printf(IP_OPTION_LBL(++optionsProcessed)); // Print label
-        bytesProcessed = 0; // Set or reset bytes processed
+    if(info->swapped) // Reverse little-endian field
+        value = (value >> 24) | ((value >> 8) & 0xFF00) | ((value << 8) & 0xFF0000) | (value << 24);
 
-        while(bytesProcessed < 4) { // Read and print IP Option bytes
-            fread(&nextByte, 1, 1, packetData); // Read byte from packet data
-            printf("%02x", nextByte & 0xFF); // Print byte
-            bytesProcessed++; // Iterate count
-        }
+    return value;
+}
+
+
+// Identifies capture layout from magic number at start of file
+// packetData is left pointing at first record of pcap captures
+// or at start of file when it holds one raw frame
+void readCaptureHeader(FILE* packetData, CaptureInfo* info) {
+    uint32_t magic = readUIntBE(packetData, 4);
+
+    info->isPcap = magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS
+                   || magic == PCAP_MAGIC_US_SWAP || magic == PCAP_MAGIC_NS_SWAP;
+    info->swapped = magic == PCAP_MAGIC_US_SWAP || magic == PCAP_MAGIC_NS_SWAP;
+    info->nanoTime = magic == PCAP_MAGIC_NS || magic == PCAP_MAGIC_NS_SWAP;
+
+    // Skip rest of pcap header, raw frames start at beginning of file
+    fseek(packetData, info->isPcap ? PCAP_GLOBAL_HDR_LEN : 0, SEEK_SET);
+}
+
+
+// Reads header of next captured frame into `record`
+// Raw frame files hold one frame with time 0 spanning whole file
+// On success packetData points to first byte of frame
+// Returns non-zero, leaving packetData unchanged, if no complete record ends before `fileEnd`
+int readCaptureRecord(FILE* packetData, const CaptureInfo* info, long fileEnd, CaptureRecord* record) {
+    long recordStart = ftell(packetData);
+    uint32_t seconds, fraction;
+
+    if(!info->isPcap) { // Whole file is one frame
+        record->time = 0;
+        record->len = fileEnd - recordStart;
+
+        return record->len <= 0;
+    }
+
+    if(recordStart + PCAP_RECORD_HDR_LEN > fileEnd) // Header incomplete
+        return 1;
+
+    seconds = readCaptureUInt(packetData, info);
+    fraction = readCaptureUInt(packetData, info);
+    record->len = readCaptureUInt(packetData, info); // Captured length
+    readCaptureUInt(packetData, info); // Original length on wire is unused
+    record->time = seconds + fraction / (info->nanoTime ? 1e9 : 1e6);
+
+    if(ftell(packetData) + record->len > fileEnd) { // Frame data incomplete
+        fseek(packetData, recordStart, SEEK_SET);
+        return 1;
     }
+
+    return 0;
 }
 
 
-// Reads and prints IPv4 Packet header from .bin file
-// packetData must already point to start of IP Header data
-// Formatting and display info defined by IP Header Format macro constants at top of file
-// Does not check for read errors or EOF  
-void printIPHeader(FILE* packetData) {
-    uint8_t nextByte;
-    uint32_t extractedBits = 0;
-    int optLen;
+// Returns total size in bytes of `file`
+// File position is left unchanged
+static inline long fileSize(FILE* file) {
+    long start = ftell(file); // Position to restore
+    long size;
 
-    printf(IP_LBL); // Print IP header label
+    fseek(file, 0, SEEK_END); // Move to end of file
+    size = ftell(file);
+    fseek(file, start, SEEK_SET); // Restore position
 
-    fread(&nextByte, 1, 1, packetData); // Read first byte
+    return size;
+}
 
-    extractedBits = (nextByte >> 4); // Extract 4-bit verion field
-    printf("%s%02x", VER_LBL, extractedBits); // Print version field
 
-    optLen = nextByte & 0x0F; // Extract 4-bit IH Length field
-    printf("%s%02x", HLEN_LBL, optLen); // Print IH length
+// Prints IPv4 address held in `address` as dotted decimal
+// Address is anonymized first when anonymizer has a key
+void printIPAddress(uint32_t address) {
+    int shift;
 
-    fread(&nextByte, 1, 1, packetData); // Read second byte
+    if(ipAnon.enabled)
+        address = anonymizeIP(&ipAnon, address);
 
-    extractedBits = (nextByte >> 2) & 0x3F; // Extract DSCP field
-    printf("%s%02x", DSCP_LBL, extractedBits); // Display DSCP field
+    // Print bytes most significant first
+    for(shift = (IP_ADR_LEN - 1) * 8; shift > 0; shift -= 8)
+        outPrintf("%u.", (address >> shift) & 0xFF);
 
-    extractedBits = nextByte & 0x03; // Extract 2-bit ECN field
-    printf("%s%02x", ECN_LBL, extractedBits); // Print ECN field
-    
-    // Print ECN value in English
-    if(extractedBits == 0) // ECN disabled
-        printf(ECN_DISABLE);
-    else if(extractedBits == 3) // Packet allows ECN
-        printf(ECN_ALLOW);
-    else // ECN field indicates congestion
-        printf(ECN_CONGESTED);
+    // Print last byte without delimiter
+    outPrintf("%u", address & 0xFF);
+}
+
+
+// Prints `label` followed by 6-byte MAC address held in `address`
+// Bytes are separated by MAC_ADDR_DELIM
+static inline void renderMAC(const char* label, uint64_t address) {
+    int shift;
+
+    outPrintf(label);
+
+    for(shift = (MAC_ADDR_LEN - 1) * 8; shift > 0; shift -= 8)
+        outPrintf("%02x%s", (unsigned int)(address >> shift) & 0xFF, MAC_ADDR_DELIM);
+
+    outPrintf("%02x", (unsigned int)address & 0xFF);
+}
 
-    fread(&nextByte, 1, 1, packetData); // Read first byte of total length
-    extractedBits = nextByte << 8; // Shift bits to left to make room for 2nd byte
 
-    fread(&nextByte, 1, 1, packetData); // Read 2nd byte of total length
-    extractedBits |= nextByte; // Combine both bytes into 1 value
+// Prints `label` followed by IPv4 address held in `address`
+static inline void renderIPv4(const char* label, uint64_t address) {
+    outPrintf(label);
+    printIPAddress((uint32_t)address);
+}
+
+
+// Prints `label` followed by `value` as at least 2 hex digits
+static inline void renderHex2(const char* label, uint64_t value) {
+    outPrintf("%s%02x", label, (unsigned int)value);
+}
+
+
+// Prints `label` followed by `value` as at least 4 hex digits
+static inline void renderHex4(const char* label, uint64_t value) {
+    outPrintf("%s%04x", label, (unsigned int)value);
+}
+
+
+// Prints `label` followed by `value` in decimal
+static inline void renderDec(const char* label, uint64_t value) {
+    outPrintf("%s%u", label, (unsigned int)value);
+}
 
-    // Print Total Length Field with bytes combined from big-endian format
-    printf("%s%u", LEN_LBL, extractedBits);
 
-    fread(&nextByte, 1, 1, packetData); // Read first byte of identification field
-    extractedBits = nextByte << 8; // Shift bits to left to make room for 2nd byte
-    
-    fread(&nextByte, 1, 1, packetData); // Read second byte of identification field
-    extractedBits |= nextByte; // Combine both bites into 1 value
+// Prints `label` and 2-bit ECN field followed by its meaning in English
+static inline void renderECN(const char* label, uint64_t ecn) {
+    outPrintf("%s%02x", label, (unsigned int)ecn);
 
-    // Print Identification with bytes combined from big-endian format
-    printf("%s%u", ID_LBL, extractedBits);
+    if(ecn == 0) // ECN disabled
+        outPrintf(ECN_DISABLE);
+    else if(ecn == 3) // Packet allows ECN
+        outPrintf(ECN_ALLOW);
+    else // ECN field indicates congestion
+        outPrintf(ECN_CONGESTED);
+}
 
-    printf(FLAGS_LBL); // Print Fragment field label
 
-    // Read byte with fragment flags and start of offset
-    fread(&nextByte, 1, 1, packetData);
+// Prints `label` and meaning of 3-bit IP fragment flags field
+static inline void renderFragFlags(const char* label, uint64_t flags) {
+    outPrintf(label);
 
-    // Display fragment status
-    if((nextByte >> 5) & 1) // More fragments being sent
-        printf(FRAG_MORE);
-    else if((nextByte >> 6) & 1) // Fragmentation not allowed
-       printf(FRAG_DISABLED);
+    if(flags & BIT_MASK_0) // More fragments being sent
+        outPrintf(FRAG_MORE);
+    else if(flags & BIT_MASK_1) // Fragmentation not allowed
+        outPrintf(FRAG_DISABLED);
     else // No Fragment flags set
-        printf(FRAG_NONE);
+        outPrintf(FRAG_NONE);
+}
+
+
+// Prints `label` and name of each TCP flag set in `flags`
+// `flags` is whole flags byte, ECN bits above URG are not named
+static inline void renderTCPFlags(const char* label, uint64_t flags) {
+    outPrintf(label);
+
+    // Check individual bits for flags
+    if(flags & BIT_MASK_5) outPrintf("URG "); // Check URGENT flag
+    if(flags & BIT_MASK_4) outPrintf("ACK "); // Check ACK flag
+    if(flags & BIT_MASK_3) outPrintf("PSH "); // Check PUSH flag
+    if(flags & BIT_MASK_2) outPrintf("RST "); // Check RESET flag
+    if(flags & BIT_MASK_1) outPrintf("SYN "); // Check SYNCHRONIZE flag
+    if(flags & BIT_MASK_0) outPrintf("FIN "); // Check Finish flag
+}
+
+
+// Reads `numBytes` bytes at `data`, at most 8, as one big-endian value
+// Generated extractors pass constant `numBytes`, so switch reduces to fixed-offset loads
+static inline uint64_t readBitsBE(const uint8_t* data, int numBytes) {
+    uint64_t value = 0;
+
+    switch(numBytes) { // Each case ORs in one byte then falls through to next
+        case 8: value |= (uint64_t)data[numBytes - 8] << 56; // fall through
+        case 7: value |= (uint64_t)data[numBytes - 7] << 48; // fall through
+        case 6: value |= (uint64_t)data[numBytes - 6] << 40; // fall through
+        case 5: value |= (uint64_t)data[numBytes - 5] << 32; // fall through
+        case 4: value |= (uint64_t)data[numBytes - 4] << 24; // fall through
+        case 3: value |= (uint64_t)data[numBytes - 3] << 16; // fall through
+        case 2: value |= (uint64_t)data[numBytes - 2] << 8; // fall through
+        case 1: value |= data[numBytes - 1];
+    }
+
+    return value;
+}
+
+
+// Generate parse and render functions of each header schema
+DEFINE_HEADER_CODEC(EthHeader, ETH_FIELDS)
+DEFINE_HEADER_CODEC(IPHeader, IP_FIELDS)
+DEFINE_HEADER_CODEC(TCPHeader, TCP_FIELDS)
+
 
-    // Extract first 5 bits of fragment offset from end of byte
-    extractedBits = nextByte & 0x1F;
+// Prints Ethernet Packet header held in `raw`
+// `raw` must hold ETH_HDR_LEN bytes
+// Fields and their formatting are defined by ETH_FIELDS schema at top of file
+void printEthernetHeader(const uint8_t* raw) {
+    EthHeader header;
 
-    fread(&nextByte, 1, 1, packetData); // Read rest of fragment offset
-    printf("%s%u", FRAG_OFF_LBL, (extractedBits << 8) | nextByte); // Display fragment offset
+    parseEthHeader(raw, &header);
 
-    fread(&nextByte, 1, 1, packetData); // Read Time to Live field
-    printf("%s%u", TTL_LBL, nextByte); // Print Time to Live field
+    outPrintf(ETHERNET_LBL); // Display packet's header
+    renderEthHeader(&header);
+}
+
+
+// Prints specified number of IP Options held in `options`
+// For each option, print macro constant defined label plus 4 bytes
+static inline void printIPOptions(const uint8_t* options, int numOptions) {
+    int optionsProcessed = 0;
 
-    fread(&nextByte, 1, 1, packetData); // Read Protocol field
-    printf("%s%u", PROTOCOL_LBL, nextByte); // Print Protocol field
+    while(optionsProcessed < numOptions) { // Iterate through IP Options
+        outPrintf(IP_OPTION_LBL(optionsProcessed + 1)); // Print label
+        outPrintf("%08x", (uint32_t)readBitsBE(options + optionsProcessed * HDR_WORD_LEN, 4)); // Print option word
+        optionsProcessed++;
+    }
+}
 
-    fread(&nextByte, 1, 1, packetData); // Read first byte of IP Checksum
-    extractedBits = nextByte << 8; // Shift bits left by 8 into extractedBits
 
-    fread(&nextByte, 1, 1, packetData); // Read second byte of IP Checksum
-    printf("%s%04x", IP_CHECKSUM_LBL, extractedBits | nextByte); // Display combined IP Checksum
+// Prints IPv4 Packet header held in `raw`
+// `raw` must hold whole header, options included, as given by its IHL field
+// Fields and their formatting are defined by IP_FIELDS schema at top of file
+void printIPHeader(const uint8_t* raw) {
+    IPHeader header;
 
-    printf(IP_SRC_LBL); // Display source IP address label
-    printIPAddress(packetData); // Display source IP Address
+    parseIPHeader(raw, &header);
 
-    printf(IP_DEST_LBL); // Display destination IP address label
-    printIPAddress(packetData); // Display destination IP Address
+    outPrintf(IP_LBL); // Print IP header label
+    renderIPHeader(&header);
 
-    if(optLen > 5) // Print IP Options
-        printIPOptions(packetData, optLen - 5);
+    if(header.ihl > 5) // Print IP Options
+        printIPOptions(raw + IP_MIN_HDR_LEN, (int)header.ihl - 5);
     else // No IP Options to print
-        printf(NO_OPTIONS_LBL);
+        outPrintf(NO_OPTIONS_LBL);
 }
 
 
@@ -354,56 +1396,60 @@ static inline uint32_t readUIntBE(FILE* data, int nBytes) {
 }
 
 
-// Reads and prints TCP Packet header from file
-// packetData must already point to start of TCP Header data
-// Formatting and display info defined by TCP Header Format macro constants at top of file
-// Does not check for read errors or EOF 
-// File pointer is advanced to end of header when successful
-void printTCPHeader(FILE* packetData) {
-    uint8_t nextByte, optWords, idx;
+// Prints TCP Packet header held in `raw`
+// `raw` must hold whole header, options included, as given by its data offset field
+// Fields and their formatting are defined by TCP_FIELDS schema at top of file
+void printTCPHeader(const uint8_t* raw) {
+    TCPHeader header;
+    unsigned int idx;
+
+    parseTCPHeader(raw, &header);
+
+    outPrintf(TCP_LBL);
+    renderTCPHeader(&header);
+
+    if(header.dataOffset > 5) { // Display options
+        for(idx = 0; idx < header.dataOffset - 5; idx++) // Process options sequentially
+            outPrintf("%s%d:\t\t0x%08x", TCP_OPT_LBL, (int)idx,
+                      (uint32_t)readBitsBE(raw + TCP_MIN_HDR_LEN + idx * HDR_WORD_LEN, 4));
+    } else { // No options in header
+        outPrintf(TCP_NO_OPT_LBL);
+    }
+}
 
-    printf(TCP_LBL);
 
-    // Read and display source and destination ports
-    printf("%s%u", SRC_PORT_LBL, readUIntBE(packetData, 2));
-    printf("%s%u", DEST_PORT_LBL, readUIntBE(packetData, 2));
+// Prints one row of payload bytes held in `row`
+// Hex bytes are separated by PAYLOAD_ delimiters, matching full payload layout
+// When `showAscii` is set, missing bytes are padded and ASCII column follows the hex
+static inline void printPayloadRow(const uint8_t* row, int rowBytes, int showAscii) {
+    int rowLen = PAYLOAD_NUM_COLS * PAYLOAD_COL_WIDTH; // Total row length
+    int idx;
 
-    // Read and display raw sequence and acknowledgment numbers
-    printf("%s%u", SEQ_NUM_LBL, readUIntBE(packetData, 4)); // Sequence number
-    printf("%s%u", ACK_NUM_LBL, readUIntBE(packetData, 4)); // Acknowledgement number
+    for(idx = 0; idx < rowLen; idx++) { // Print hex for each byte in row
+        if(idx < rowBytes) // Byte present
+            outPrintf("%02x", row[idx]);
+        else if(showAscii) // Pad missing byte to align ASCII column
+            outPrintf(PAYLOAD_ASCII_PAD);
+        else // Partial row complete
+            break;
 
-    // Read and display header data offset (total number of 4-Byte words in header)
-    fread(&nextByte, 1, 1, packetData); // Read full byte of data
-    nextByte >>= 4; // Right shift by 4 to isolate leading 4 bytes
-    optWords = nextByte - 5; // Set number of 4-byte words in options
-    printf("%s%u", DATA_OFS_LBL, nextByte); // Display Data offset
+        if(idx == rowLen - 1) { // End of row reached
+            if(!showAscii) // ASCII column ends row instead
+                outPrintf(PAYLOAD_ROW_DELIM);
+        } else if(idx % PAYLOAD_COL_WIDTH == PAYLOAD_COL_WIDTH - 1) { // End of column reached
+            outPrintf(PAYLOAD_COL_DELIM);
+        } else { // Use standard delimiter
+            outPrintf(PAYLOAD_DELIM);
+        }
+    }
 
-    // Read Byte containing flags
-    printf(TCP_FLAGS_LBL); // Display flags header
-    fread(&nextByte, 1, 1, packetData); // Read next byte
+    if(showAscii) { // Print ASCII column from same row bytes
+        outPrintf(PAYLOAD_ASCII_DELIM);
 
-    // Check individual bits for flags
-    if(nextByte & BIT_MASK_5) printf("URG "); // Check URGENT flag
-    if(nextByte & BIT_MASK_4) printf("ACK "); // Check ACK flag
-    if(nextByte & BIT_MASK_3) printf("PSH "); // Check PUSH flag
-    if(nextByte & BIT_MASK_2) printf("RST "); // Check RESET flag
-    if(nextByte & BIT_MASK_1) printf("SYN "); // Check SYNCHRONIZE flag
-    if(nextByte & BIT_MASK_0) printf("FIN "); // Check Finish flag
-
-    // Read and display advertised window field
-    printf("%s%u", WINDOW_SIZE_LBL, readUIntBE(packetData, 2));
-    
-    // Read and display TCP checksum field
-    printf("%s%02x", TCP_CHECKSUM_LBL, readUIntBE(packetData, 2));
-
-    // Read and display urgent pointer field
-    printf("%s%u", TCP_URG_PTR_LBL, readUIntBE(packetData, 2));
-
-    if(optWords > 0) { // Read and display options
-        for(idx = 0; idx < optWords; idx++) // Process options sequentially
-            printf("%s%d:\t\t0x%08x", TCP_OPT_LBL, idx, readUIntBE(packetData, 4));
-    } else { // No options in header
-        printf(TCP_NO_OPT_LBL);
+        for(idx = 0; idx < rowBytes; idx++)
+            outPutc(isprint(row[idx]) ? row[idx] : PAYLOAD_NON_PRINT);
+
+        outPrintf(PAYLOAD_ASCII_END PAYLOAD_ROW_DELIM);
     }
 }
 
@@ -411,25 +1457,2872 @@ void printTCPHeader(FILE* packetData) {
 // Prints the payload portion of an Ethernet packet
 // Prints in the column-based format specified by PAYLOAD_ Macro constants
 // `payloadData` argument must point to begining of payload data
-// Returns the number of bytes read
-int printPayload(FILE* packetData) {
-    int bytesRead = 0; // Tracks total bytes read
-    int rowLen = PAYLOAD_NUM_COLS * PAYLOAD_COL_WIDTH; // Total row length
+// At most `opts->snapLen` bytes are rendered, the rest are skipped without being read
+// File pointer is advanced `payloadLen` bytes
+// Returns the number of bytes rendered
+long printPayload(FILE* packetData, long payloadLen, const DecodeOptions* opts) {
+    uint8_t row[PAYLOAD_NUM_COLS * PAYLOAD_COL_WIDTH]; // Bytes of current row
+    long renderLen = payloadLen; // Number of bytes to render
+    long bytesRead = 0; // Tracks total bytes read
+    int rowBytes; // Bytes in current row
 
-    // Print bytes until end of file
-    while(printByteSafe(packetData)) {
-        if(bytesRead % rowLen == rowLen - 1) { // End of row reached
-            printf(PAYLOAD_ROW_DELIM);
-        } else if(bytesRead % PAYLOAD_COL_WIDTH == PAYLOAD_COL_WIDTH - 1) { // End of column reached
-            printf(PAYLOAD_COL_DELIM);        
-        } else { // Use standard delimiter
-            printf(PAYLOAD_DELIM);
-        }
+    if(opts->snapLen != NO_SNAPLEN && opts->snapLen < renderLen) // Cap to snap length
+        renderLen = opts->snapLen;
+
+    while(bytesRead < renderLen) { // Read and print payload a row at a time
+        rowBytes = (int)sizeof(row);
+
+        if(renderLen - bytesRead < rowBytes) // Final partial row
+            rowBytes = (int)(renderLen - bytesRead);
+
+        rowBytes = (int)fread(row, 1, rowBytes, packetData);
+
+        if(rowBytes == 0) // End of file reached early
+            break;
 
-        bytesRead++; // Increment count
+        printPayloadRow(row, rowBytes, opts->showAscii);
+        bytesRead += rowBytes; // Increment count
+    }
+
+    if(bytesRead < payloadLen) { // Skip rest of payload by offset
+        fseek(packetData, payloadLen - bytesRead, SEEK_CUR);
+        outPrintf(PAYLOAD_SNAP_LBL, payloadLen - bytesRead);
     }
 
     return bytesRead;
 }
 
 
+// Decodes and displays every frame in capture file
+// Files without pcap header are decoded as one raw frame spanning whole file
+// When writing captures, selected frames are copied to them instead of being displayed
+// When following, records appended to pcap capture are decoded until interrupted
+// Returns 0 on success, ERR_NO_MEMORY if a payload could not be buffered
+// or ERR_WRITE_FAILED if an output capture could not be written
+int decodeCapture(FILE* packetData, DecodeContext* ctx) {
+    long fileEnd; // Size of capture when records were last read
+    int writing = ctx->opts->writePath || ctx->opts->splitDir; // Frames copied to captures
+    int errCode = 0;
+#ifdef HAVE_FOLLOW
+    FollowState follow;
+
+    if(ctx->opts->follow) { // Start watching, capture header may not be written yet
+        followInit(&follow, ctx->opts->path);
+
+        if(followHeader(&follow, packetData)) { // Interrupted first
+            followFree(&follow);
+            return 0;
+        }
+    }
+#endif
+
+    readCaptureHeader(packetData, &ctx->capture);
+
+    if(writing) // Create output capture before first frame
+        errCode = pcapOpen(&ctx->writer, ctx->opts, packetData, &ctx->capture);
+
+    fileEnd = fileSize(packetData);
+
+    if(!errCode)
+        errCode = decodeRecords(packetData, fileEnd, ctx);
+
+#ifdef HAVE_FOLLOW
+    // Decode records as they are appended, incomplete record is read again once finished
+    while(!errCode && ctx->opts->follow && ctx->capture.isPcap) {
+        outSubmit(&outSink); // Show decoded frames before waiting
+
+        if(writing && (errCode = pcapSync(&ctx->writer)))
+            break;
+
+        if(followNext(&follow, packetData, fileEnd, &ctx->capture)) // Interrupted
+            break;
+
+        fileEnd = fileSize(packetData);
+        errCode = decodeRecords(packetData, fileEnd, ctx);
+    }
+
+    if(ctx->opts->follow)
+        followFree(&follow);
+#endif
+
+    if(writing && pcapClose(&ctx->writer) && !errCode) // Write buffered records
+        errCode = ERR_WRITE_FAILED;
+
+    return errCode;
+}
+
+
+// Decodes and displays every complete record ending before `fileEnd`
+// packetData must point to first record, and is left pointing after last complete record
+// When following, stops before next record once interrupted
+// Returns 0 on success, ERR_NO_MEMORY if a payload could not be buffered
+// or ERR_WRITE_FAILED if a frame could not be copied
+int decodeRecords(FILE* packetData, long fileEnd, DecodeContext* ctx) {
+    CaptureRecord record; // Current frame
+    long frameStart;
+    int errCode = 0;
+
+    while(!errCode) {
+#ifdef HAVE_FOLLOW
+        if(ctx->opts->follow && followStopped) // Interrupted while decoding backlog
+            break;
+#endif
+
+        if(readCaptureRecord(packetData, &ctx->capture, fileEnd, &record))
+            break;
+
+        frameStart = ftell(packetData);
+        ctx->counts.frames++;
+
+        // Sampling decides before any header is parsed
+        if(!sampleFrame(packetData, record.len, record.time, ctx)) {
+            ctx->counts.skipped++;
+            fseek(packetData, frameStart + record.len, SEEK_SET); // Skip by record length
+            continue;
+        }
+
+        ctx->counts.sampled++;
+
+        // Suppress second copy of mirrored frame before it is formatted
+        if(ctx->opts->dedupWindow > 0 && isDuplicate(packetData, record.len, record.time, ctx)) {
+            ctx->counts.duplicates++;
+            fseek(packetData, frameStart + record.len, SEEK_SET);
+            continue;
+        }
+
+        errCode = decodeFrame(packetData, record.len, ctx);
+    }
+
+    return errCode;
+}
+
+
+// Decodes and displays one Ethernet frame of `frameLen` bytes
+// packetData must point to start of frame, and is advanced to end of frame
+// When searching, frame is only displayed if a pattern matches its payload
+// When writing captures, frame is copied to its capture instead of being displayed
+// When anonymizing, frames without whole IPv4 header are not displayed
+// Returns 0 on success, ERR_NO_MEMORY if payload could not be buffered
+// or ERR_WRITE_FAILED if frame could not be copied
+int decodeFrame(FILE* packetData, long frameLen, DecodeContext* ctx) {
+    const DecodeOptions* opts = ctx->opts;
+    uint8_t headers[FRAME_HDR_MAX_LEN]; // Leading frame bytes holding every rendered header
+    long frameStart = ftell(packetData); // Offset of first byte of frame
+    long headersLen, payloadStart, ipLen, tcpLen;
+    int errCode;
+
+    if(opts->numPatterns > 0) { // Only display frames matching search patterns
+        errCode = searchFrame(packetData, frameLen, ctx);
+
+        if(errCode || ctx->results.count == 0) { // Skip frame
+            fseek(packetData, frameStart + frameLen, SEEK_SET);
+            return errCode;
+        }
+    }
+
+    if(opts->writePath || opts->splitDir) { // Copy original bytes instead of displaying
+        errCode = pcapWriteFrame(&ctx->writer, packetData, frameLen);
+        fseek(packetData, frameStart + frameLen, SEEK_SET);
+        return errCode;
+    }
+
+    // Headers are rendered from bytes of this frame only, incomplete ones are left to payload
+    headersLen = (long)fread(headers, 1, frameLen < FRAME_HDR_MAX_LEN ? frameLen : FRAME_HDR_MAX_LEN, packetData);
+    payloadStart = payloadOffset(headers, headersLen, &ipLen, &tcpLen);
+
+    if(ipAnon.enabled && ipLen == 0) { // Addresses in frame without IP header would be shown raw
+        ctx->counts.anonDropped++;
+        fseek(packetData, frameStart + frameLen, SEEK_SET);
+        return 0;
+    }
+
+    if(ctx->framesShown++ > 0) // Separate from previous frame
+        outPrintf(FRAME_DELIM);
+
+    if(ctx->capture.isPcap) // Label frames with position in capture
+        outPrintf(FRAME_LBL, ctx->counts.frames);
+
+    if(payloadStart >= ETH_HDR_LEN) // Process Ethernet header
+        printEthernetHeader(headers);
+
+    if(ipLen > 0) // Process IP header of IPv4 frame
+        printIPHeader(headers + ETH_HDR_LEN);
+
+    if(tcpLen > 0) // Process TCP header of TCP segment
+        printTCPHeader(headers + ETH_HDR_LEN + ipLen);
+
+    if(opts->mode == OUT_MODE_FULL) { // Payload only rendered when requested
+        outPrintf(PAYLOAD_LBL); // Process payload
+        fseek(packetData, frameStart + payloadStart, SEEK_SET);
+        printPayload(packetData, frameLen - payloadStart, opts);
+    }
+
+    if(opts->numPatterns > 0) // Display where patterns were found
+        printMatches(&ctx->results, opts);
+
+    fseek(packetData, frameStart + frameLen, SEEK_SET); // Move to end of frame
+
+    return 0;
+}
+
+
+// Decides whether frame is decoded using enabled samplers
+// Only flow sampling reads frame bytes, and only those holding addresses and ports
+// packetData must point to start of frame, and is left pointing at start of frame
+// Returns non-zero if frame passes every enabled sampler
+int sampleFrame(FILE* packetData, long frameLen, double time, DecodeContext* ctx) {
+    const DecodeOptions* opts = ctx->opts;
+    SamplerState* sampler = &ctx->sampler;
+    double capacity = opts->rateLimit > 1 ? opts->rateLimit : 1; // Bucket must reach 1 token at rates below 1
+
+    if(opts->sampleNth > 0 && sampler->counter++ % opts->sampleNth != 0) // 1 in N frames
+        return 0;
+
+    // Hash is symmetric so both directions of a flow are kept together
+    if(opts->sampleFlows > 0 && flowHash(packetData, frameLen) % opts->sampleFlows != 0)
+        return 0;
+
+    if(opts->rateLimit > 0) { // Token bucket refilled by capture time, holds 1 second of frames or 1 frame
+        if(!sampler->started) { // Start with full bucket
+            sampler->tokens = capacity;
+            sampler->started = 1;
+        } else if(time > sampler->lastTime) { // Refill for time elapsed
+            sampler->tokens += (time - sampler->lastTime) * opts->rateLimit;
+
+            if(sampler->tokens > capacity)
+                sampler->tokens = capacity;
+        }
+
+        if(time > sampler->lastTime)
+            sampler->lastTime = time;
+
+        if(sampler->tokens < 1) // Rate exceeded
+            return 0;
+
+        sampler->tokens -= 1;
+    }
+
+    return 1;
+}
+
+
+// Reads protocol, addresses and ports of IPv4 frame into `fields`
+// Only leading FLOW_PEEK_LEN bytes of frame are read, headers are not decoded
+// packetData must point to start of frame, and is left pointing at start of frame
+// Returns non-zero if frame is too short or not IPv4
+static inline int peekFlowFields(FILE* packetData, long frameLen, FlowFields* fields) {
+    uint8_t peek[FLOW_PEEK_LEN]; // Leading bytes of frame
+    long frameStart = ftell(packetData);
+    long peekLen = frameLen < FLOW_PEEK_LEN ? frameLen : FLOW_PEEK_LEN;
+    const uint8_t* ip = peek + ETH_HDR_LEN;
+    int ipLen;
+
+    peekLen = (long)fread(peek, 1, peekLen, packetData);
+    fseek(packetData, frameStart, SEEK_SET); // Restore position
+
+    // Frame must hold fixed IP header of IPv4 type
+    if(peekLen < ETH_HDR_LEN + IP_MIN_HDR_LEN
+       || ((peek[ETH_TYPE_POS] << 8) | peek[ETH_TYPE_POS + 1]) != ETH_TYPE_IPV4)
+        return 1;
+
+    fields->srcIP = ((uint32_t)ip[IP_SRC_POS] << 24) | (ip[IP_SRC_POS + 1] << 16) | (ip[IP_SRC_POS + 2] << 8) | ip[IP_SRC_POS + 3];
+    fields->destIP = ((uint32_t)ip[IP_DEST_POS] << 24) | (ip[IP_DEST_POS + 1] << 16) | (ip[IP_DEST_POS + 2] << 8) | ip[IP_DEST_POS + 3];
+    fields->protocol = ip[IP_PROTO_POS];
+    ipLen = (ip[0] & 0x0F) * HDR_WORD_LEN;
+
+    // Ports follow valid IP header for TCP and UDP, later fragments hold payload there instead
+    fields->hasPorts = (fields->protocol == IP_PROTO_TCP || fields->protocol == IP_PROTO_UDP)
+                       && ipLen >= IP_MIN_HDR_LEN && (readBitsBE(ip + IP_FRAG_POS, 2) & 0x1FFF) == 0
+                       && ETH_HDR_LEN + ipLen + 4 <= peekLen;
+    fields->srcPort = fields->hasPorts ? (uint16_t)((ip[ipLen] << 8) | ip[ipLen + 1]) : 0;
+    fields->destPort = fields->hasPorts ? (uint16_t)((ip[ipLen + 2] << 8) | ip[ipLen + 3]) : 0;
+
+    return 0;
+}
+
+
+// Hashes protocol, addresses and ports of IPv4 frame, same for both directions
+// Non-IPv4 frames have no flow, they hash by their bytes so 1 in N of them is sampled too
+// packetData must point to start of frame, and is left pointing at start of frame
+static inline uint64_t flowHash(FILE* packetData, long frameLen) {
+    FlowFields fields;
+
+    if(peekFlowFields(packetData, frameLen, &fields)) // Not IPv4
+        return frameFingerprint(packetData, frameLen);
+
+    // XOR and sum of each field pair do not depend on direction
+    return mixBits(mixBits(((uint64_t)(fields.srcIP ^ fields.destIP) << 32) | (fields.srcIP + fields.destIP))
+                   ^ (((uint64_t)fields.protocol << 32) | (uint32_t)(fields.srcPort ^ fields.destPort)));
+}
+
+
+// Scrambles bits of `value` so every input bit affects every output bit
+static inline uint64_t mixBits(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+
+    return value;
+}
+
+
+// Allocates empty fingerprint ring and index
+// Returns 0 on success or ERR_NO_MEMORY
+int dedupInit(DedupState* dedup) {
+    dedup->ring = calloc(DEDUP_RING_SIZE, sizeof(DedupRecord));
+    dedup->index = calloc(DEDUP_BUCKETS * DEDUP_WAYS, sizeof(DedupSlot));
+    dedup->seq = 0;
+
+    if(!dedup->ring || !dedup->index) {
+        dedupFree(dedup);
+        return ERR_NO_MEMORY;
+    }
+
+    return 0;
+}
+
+
+// Releases fingerprint ring and index allocated with dedupInit
+void dedupFree(DedupState* dedup) {
+    free(dedup->ring);
+    free(dedup->index);
+    memset(dedup, 0, sizeof(*dedup));
+}
+
+
+// Checks whether frame repeats one seen within duplicate window
+// Frames not repeated are added to ring, replacing oldest fingerprint
+// Duplicates beyond DEDUP_RING_SIZE frames back are not detected
+// packetData must point to start of frame, and is left pointing at start of frame
+// Returns non-zero if frame is duplicate
+int isDuplicate(FILE* packetData, long frameLen, double time, DecodeContext* ctx) {
+    DedupState* dedup = &ctx->dedup;
+    uint64_t fingerprint = frameFingerprint(packetData, frameLen);
+    DedupSlot* bucket = dedup->index + (fingerprint & (DEDUP_BUCKETS - 1)) * DEDUP_WAYS;
+    uint32_t tag = (uint32_t)(fingerprint >> 32);
+    const DedupRecord* record;
+    int way, victim = 0;
+
+    for(way = 0; way < DEDUP_WAYS; way++) {
+        // Slot must point at record still in ring holding same fingerprint
+        if(bucket[way].seq && bucket[way].tag == tag && dedup->seq - (bucket[way].seq - 1) <= DEDUP_RING_SIZE) {
+            record = &dedup->ring[(bucket[way].seq - 1) % DEDUP_RING_SIZE];
+
+            if(record->fingerprint == fingerprint && time - record->time <= ctx->opts->dedupWindow)
+                return 1;
+        }
+
+        // Replace unused slot, else slot of oldest record
+        if(bucket[victim].seq && (!bucket[way].seq || bucket[way].seq - bucket[victim].seq > (1u << 31)))
+            victim = way;
+    }
+
+    dedup->ring[dedup->seq % DEDUP_RING_SIZE].fingerprint = fingerprint;
+    dedup->ring[dedup->seq % DEDUP_RING_SIZE].time = time;
+    bucket[victim].tag = tag;
+    bucket[victim].seq = ++dedup->seq; // Stored plus one so 0 marks unused
+
+    return 0;
+}
+
+
+// Hashes every byte of frame except those a router forwarding it rewrites
+// Ingress and egress copies of mirrored frame may sit on either side of a router,
+// so IPv4 frames are hashed from IP header on without time to live and checksum
+// Frames not IPv4 are hashed whole
+// packetData must point to start of frame, and is left pointing at start of frame
+static inline uint64_t frameFingerprint(FILE* packetData, long frameLen) {
+    uint8_t chunk[DEDUP_CHUNK_LEN]; // Frame bytes being hashed
+    long frameStart = ftell(packetData), hashed = 0;
+    uint64_t hash = mixBits((uint64_t)frameLen), word;
+    size_t chunkLen, pos;
+    int isIPv4;
+
+    // Skip Ethernet header of IPv4 frames, MAC addresses change at each router
+    isIPv4 = frameLen >= ETH_HDR_LEN + IP_MIN_HDR_LEN && fread(chunk, 1, ETH_HDR_LEN, packetData) == ETH_HDR_LEN
+             && ((chunk[ETH_TYPE_POS] << 8) | chunk[ETH_TYPE_POS + 1]) == ETH_TYPE_IPV4;
+
+    if(isIPv4)
+        hashed = ETH_HDR_LEN;
+    else
+        fseek(packetData, frameStart, SEEK_SET);
+
+    while(hashed < frameLen) { // Hash frame a chunk at a time
+        chunkLen = frameLen - hashed < DEDUP_CHUNK_LEN ? (size_t)(frameLen - hashed) : DEDUP_CHUNK_LEN;
+        chunkLen = fread(chunk, 1, chunkLen, packetData);
+
+        if(chunkLen == 0) // Frame ends early
+            break;
+
+        // First chunk of IPv4 frame starts with IP header, blank fields which vary between copies
+        if(isIPv4 && hashed == ETH_HDR_LEN && chunkLen >= IP_MIN_HDR_LEN) {
+            chunk[IP_TTL_POS] = 0;
+            chunk[IP_CHECKSUM_POS] = 0;
+            chunk[IP_CHECKSUM_POS + 1] = 0;
+        }
+
+        for(pos = 0; pos + 8 <= chunkLen; pos += 8) { // Mix in 8 bytes at a time
+            memcpy(&word, chunk + pos, 8);
+            hash = mixBits(hash ^ word);
+        }
+
+        if(pos < chunkLen) { // Final partial word, only possible in last chunk
+            word = 0;
+            memcpy(&word, chunk + pos, chunkLen - pos);
+            hash = mixBits(hash ^ word);
+        }
+
+        hashed += (long)chunkLen;
+    }
+
+    fseek(packetData, frameStart, SEEK_SET); // Restore position
+
+    return hash;
+}
+
+
+// Finds offset of payload from start of `frameLen` bytes of `frame`, the bytes after its last whole header
+// `ipLen` is set to IP header length of IPv4 frame holding its whole IP header, else 0
+// `tcpLen` is set to TCP header length when whole TCP header of first fragment follows, else 0
+// Frames too short for Ethernet header are all payload
+static inline long payloadOffset(const uint8_t* frame, long frameLen, long* ipLen, long* tcpLen) {
+    const uint8_t* ip = frame + ETH_HDR_LEN;
+    long len;
+
+    *ipLen = 0;
+    *tcpLen = 0;
+
+    if(frameLen < ETH_HDR_LEN) // No whole Ethernet header
+        return 0;
+
+    if(frameLen < ETH_HDR_LEN + IP_MIN_HDR_LEN
+       || ((frame[ETH_TYPE_POS] << 8) | frame[ETH_TYPE_POS + 1]) != ETH_TYPE_IPV4)
+        return ETH_HDR_LEN;
+
+    len = (ip[0] & 0x0F) * HDR_WORD_LEN; // IP header length in bytes
+
+    if(len < IP_MIN_HDR_LEN || ETH_HDR_LEN + len > frameLen) // Malformed or cut IP header
+        return ETH_HDR_LEN;
+
+    *ipLen = len;
+
+    // Later fragments carry no TCP header
+    if(ip[IP_PROTO_POS] != IP_PROTO_TCP || (readBitsBE(ip + IP_FRAG_POS, 2) & 0x1FFF) != 0
+       || ETH_HDR_LEN + *ipLen + TCP_MIN_HDR_LEN > frameLen)
+        return ETH_HDR_LEN + *ipLen;
+
+    len = (ip[*ipLen + TCP_DATA_OFS_POS] >> 4) * HDR_WORD_LEN; // TCP header length in bytes
+
+    if(len < TCP_MIN_HDR_LEN || ETH_HDR_LEN + *ipLen + len > frameLen) // Malformed or cut TCP header
+        return ETH_HDR_LEN + *ipLen;
+
+    *tcpLen = len;
+
+    return ETH_HDR_LEN + *ipLen + *tcpLen;
+}
+
+
+// Reads frame into context's reusable buffer and searches its raw payload for all patterns
+// packetData must point to start of frame, and is left pointing at start of frame
+// Matches are stored in `results`, replacing any from previous frames
+// Returns 0 on success or ERR_NO_MEMORY if frame could not be buffered
+int searchFrame(FILE* packetData, long frameLen, DecodeContext* ctx) {
+    SearchResults* results = &ctx->results;
+    long frameStart = ftell(packetData);
+    long payloadStart; // Payload offset within frame
+    long ipLen, tcpLen;
+    uint8_t* grown;
+
+    results->count = 0; // Discard previous matches
+
+    if(frameLen > ctx->frameBufLen) { // Grow buffer to largest frame seen
+        grown = realloc(ctx->frameBuf, frameLen);
+
+        if(!grown)
+            return ERR_NO_MEMORY;
+
+        ctx->frameBuf = grown;
+        ctx->frameBufLen = frameLen;
+    }
+
+    frameLen = (long)fread(ctx->frameBuf, 1, frameLen, packetData);
+    fseek(packetData, frameStart, SEEK_SET); // Restore position
+
+    payloadStart = payloadOffset(ctx->frameBuf, frameLen, &ipLen, &tcpLen);
+
+    if(payloadStart >= frameLen) // No payload to search
+        return 0;
+
+    return searchPayload(&ctx->ac, ctx->opts->patterns, ctx->frameBuf + payloadStart,
+                         frameLen - payloadStart, results);
+}
+
+
+// Prints offset and pattern of each match in `results`
+// Formatting defined by MATCH_ macro constants at top of file
+void printMatches(const SearchResults* results, const DecodeOptions* opts) {
+    const SearchPattern* pattern;
+    int idx;
+
+    outPrintf(MATCH_LBL);
+
+    for(idx = 0; idx < results->count; idx++) { // Print each match
+        pattern = &opts->patterns[results->items[idx].pattern];
+        outPrintf(MATCH_OFS_LBL, results->items[idx].offset);
+        outPrintf(pattern->isHex ? MATCH_HEX_FMT : MATCH_STR_FMT, pattern->label);
+    }
+}
+
+
+// Builds Aho-Corasick automaton matching every pattern in `patterns`
+// Transitions are fully resolved so scanning takes one table lookup per byte
+// Returns 0 on success, ERR_NO_MEMORY or ERR_TOO_MANY_PATTERNS otherwise
+int buildAutomaton(SearchAutomaton* ac, const SearchPattern* patterns, int numPatterns) {
+    long maxStates = 1; // Trie has at most one state per pattern byte plus root
+    int32_t* fail = NULL; // Longest proper suffix state of each state
+    int32_t* queue = NULL; // Breadth-first order of states
+    int head = 0, tail = 0;
+    int pat, idx, cls, state, child, nextState, errCode = 0;
+    uint8_t byte;
+
+    memset(ac, 0, sizeof(*ac));
+
+    // Assign transition columns to bytes used by patterns, others share column 0
+    ac->numClasses = 1;
+
+    for(pat = 0; pat < numPatterns; pat++) {
+        maxStates += patterns[pat].len;
+
+        for(idx = 0; idx < patterns[pat].len; idx++) {
+            if(!ac->byteClass[patterns[pat].bytes[idx]])
+                ac->byteClass[patterns[pat].bytes[idx]] = (uint16_t)ac->numClasses++;
+        }
+    }
+
+    if(maxStates > AC_MAX_STATES) // State numbers must fit table entries
+        return ERR_TOO_MANY_PATTERNS;
+
+    ac->next = calloc(maxStates * ac->numClasses, sizeof(uint16_t));
+    ac->match = malloc(maxStates * sizeof(int32_t));
+    ac->outLink = malloc(maxStates * sizeof(int32_t));
+    ac->patNext = malloc(numPatterns * sizeof(int32_t));
+    ac->reports = calloc(maxStates, 1);
+    fail = calloc(maxStates, sizeof(int32_t));
+    queue = malloc(maxStates * sizeof(int32_t));
+
+    if(!ac->next || !ac->match || !ac->outLink || !ac->patNext || !ac->reports
+       || !fail || !queue) {
+        errCode = ERR_NO_MEMORY;
+    } else {
+        for(idx = 0; idx < maxStates; idx++) { // No state has matches yet
+            ac->match[idx] = AC_NO_PATTERN;
+            ac->outLink[idx] = AC_NO_PATTERN;
+        }
+
+        ac->numStates = 1; // Start with root only
+
+        for(pat = 0; pat < numPatterns; pat++) { // Insert each pattern into trie
+            state = AC_ROOT;
+
+            for(idx = 0; idx < patterns[pat].len; idx++) {
+                byte = patterns[pat].bytes[idx];
+                cls = ac->byteClass[byte];
+
+                if(idx == 0 && !ac->isFirst[byte]) { // Record distinct first bytes
+                    if(ac->numFirst < AC_SSE2_MAX_FIRST)
+                        ac->firstBytes[ac->numFirst] = byte;
+
+                    ac->numFirst++;
+                    ac->isFirst[byte] = 1;
+                    ac->loMask[byte & 0x0F] |= (uint8_t)(1 << ((byte >> 4) & 0x07));
+                }
+
+                if(!ac->next[state * ac->numClasses + cls]) // No edge yet, trie never links to root
+                    ac->next[state * ac->numClasses + cls] = (uint16_t)ac->numStates++;
+
+                state = ac->next[state * ac->numClasses + cls];
+            }
+
+            ac->patNext[pat] = ac->match[state]; // Add pattern to state's list
+            ac->match[state] = pat;
+            ac->reports[state] = 1;
+        }
+
+        for(idx = 0; idx < 16; idx++) // High nibbles share 8 prefilter buckets
+            ac->hiMask[idx] = (uint8_t)(1 << (idx & 0x07));
+
+        // With many first bytes most payload bytes are candidates, stepping automaton is cheaper
+        ac->prefilter = ac->numFirst <= AC_PREFILTER_MAX_FIRST;
+
+        for(cls = 0; cls < ac->numClasses; cls++) { // Queue depth 1 states, they fail to root
+            if(ac->next[cls])
+                queue[tail++] = ac->next[cls];
+        }
+
+        while(head < tail) { // Resolve transitions in breadth-first order
+            state = queue[head++];
+
+            // Inherit matches of longest suffix
+            if(ac->match[fail[state]] != AC_NO_PATTERN)
+                ac->outLink[state] = fail[state];
+            else
+                ac->outLink[state] = ac->outLink[fail[state]];
+
+            if(ac->outLink[state] != AC_NO_PATTERN)
+                ac->reports[state] = 1;
+
+            for(cls = 0; cls < ac->numClasses; cls++) {
+                child = ac->next[state * ac->numClasses + cls];
+                nextState = ac->next[fail[state] * ac->numClasses + cls];
+
+                if(child) { // Trie edge, child fails to where suffix goes
+                    fail[child] = nextState;
+                    queue[tail++] = child;
+                } else { // Missing edge follows suffix transition
+                    ac->next[state * ac->numClasses + cls] = (uint16_t)nextState;
+                }
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+
+    if(errCode)
+        freeAutomaton(ac);
+
+    return errCode;
+}
+
+
+// Releases memory held by automaton built with buildAutomaton
+void freeAutomaton(SearchAutomaton* ac) {
+    free(ac->next);
+    free(ac->match);
+    free(ac->outLink);
+    free(ac->patNext);
+    free(ac->reports);
+    memset(ac, 0, sizeof(*ac));
+}
+
+
+// Returns position of first byte at or after `pos` that may begin a pattern
+// Returns `len` if no such byte exists
+// Vector paths test 16 bytes per step, scalar loop finishes remainder
+static inline long prefilterSkip(const SearchAutomaton* ac, const uint8_t* data, long pos, long len) {
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128i chunk, eq;
+    int hits, idx;
+#endif
+
+#if defined(AC_SHUFFLE)
+    if(AC_HAVE_SHUFFLE())
+        return prefilterSkipShuffle(ac, data, pos, len);
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) // Compare 16 bytes against each first byte
+    if(ac->numFirst <= AC_SSE2_MAX_FIRST) {
+        while(pos + AC_VEC_WIDTH <= len) {
+            chunk = _mm_loadu_si128((const __m128i*)(data + pos));
+            eq = _mm_setzero_si128();
+
+            for(idx = 0; idx < ac->numFirst; idx++)
+                eq = _mm_or_si128(eq, _mm_cmpeq_epi8(chunk, _mm_set1_epi8((char)ac->firstBytes[idx])));
+
+            hits = _mm_movemask_epi8(eq);
+
+            if(hits) { // Index of first matching byte
+                for(idx = 0; !(hits & (1 << idx)); idx++);
+                return pos + idx;
+            }
+
+            pos += AC_VEC_WIDTH;
+        }
+    }
+#endif
+
+    while(pos < len && !ac->isFirst[data[pos]]) // Scalar scan of remaining bytes
+        pos++;
+
+    return pos;
+}
+
+
+#if defined(AC_SHUFFLE)
+// Returns same position as prefilterSkip, looking up nibble buckets of 16 bytes with shuffles
+AC_TARGET static long prefilterSkipShuffle(const SearchAutomaton* ac, const uint8_t* data, long pos, long len) {
+    const __m128i loMask = _mm_loadu_si128((const __m128i*)ac->loMask);
+    const __m128i hiMask = _mm_loadu_si128((const __m128i*)ac->hiMask);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    __m128i chunk, buckets;
+    int hits;
+
+    while(pos + AC_VEC_WIDTH <= len) {
+        chunk = _mm_loadu_si128((const __m128i*)(data + pos));
+        buckets = _mm_and_si128(_mm_shuffle_epi8(loMask, _mm_and_si128(chunk, nibble)),
+                                _mm_shuffle_epi8(hiMask, _mm_and_si128(_mm_srli_epi16(chunk, 4), nibble)));
+
+        // Bytes with no shared bucket cannot begin a pattern
+        hits = ~_mm_movemask_epi8(_mm_cmpeq_epi8(buckets, _mm_setzero_si128())) & 0xFFFF;
+
+        while(hits) { // Confirm candidates against exact first byte table
+            if(ac->isFirst[data[pos + __builtin_ctz(hits)]])
+                return pos + __builtin_ctz(hits);
+
+            hits &= hits - 1;
+        }
+
+        pos += AC_VEC_WIDTH;
+    }
+
+    while(pos < len && !ac->isFirst[data[pos]]) // Scalar scan of remaining bytes
+        pos++;
+
+    return pos;
+}
+#endif
+
+
+// Scans `len` bytes of `data` for every pattern in one pass
+// Each match is appended to `results` with offset of its first byte
+// Returns 0 on success or ERR_NO_MEMORY if results could not grow
+int searchPayload(const SearchAutomaton* ac, const SearchPattern* patterns,
+                  const uint8_t* data, long len, SearchResults* results) {
+    SearchMatch* grown;
+    long pos = 0;
+    int state = AC_ROOT, reportState, pat;
+
+    while(pos < len) {
+        if(state == AC_ROOT && ac->prefilter) { // Skip bytes which cannot begin a match
+            pos = prefilterSkip(ac, data, pos, len);
+
+            if(pos >= len)
+                break;
+        }
+
+        state = ac->next[state * ac->numClasses + ac->byteClass[data[pos]]];
+
+        if(ac->reports[state]) { // One or more patterns end at this byte
+            reportState = ac->match[state] != AC_NO_PATTERN ? state : ac->outLink[state];
+
+            while(reportState != AC_NO_PATTERN) { // Walk suffix states with matches
+                for(pat = ac->match[reportState]; pat != AC_NO_PATTERN; pat = ac->patNext[pat]) {
+                    if(results->count == results->capacity) { // Grow results
+                        results->capacity = results->capacity ? results->capacity * 2 : 16;
+                        grown = realloc(results->items, results->capacity * sizeof(SearchMatch));
+
+                        if(!grown)
+                            return ERR_NO_MEMORY;
+
+                        results->items = grown;
+                    }
+
+                    results->items[results->count].offset = pos - patterns[pat].len + 1;
+                    results->items[results->count].pattern = pat;
+                    results->count++;
+                }
+
+                reportState = ac->outLink[reportState];
+            }
+        }
+
+        pos++;
+    }
+
+    return 0;
+}
+
+
+// Prepares `sink` for output and starts its writer thread
+// Falls back to writing on calling thread if thread cannot be started
+// Returns 0 on success or ERR_NO_MEMORY if buffers could not be allocated
+int outOpen(OutputSink* sink) {
+    int idx;
+#ifdef OUT_SPLICE
+    struct stat outStat;
+#endif
+
+    memset(sink, 0, sizeof(*sink));
+
+    for(idx = 0; idx < OUT_NUM_BUFS; idx++) { // Allocate buffers
+        sink->bufs[idx] = outAllocBuf();
+
+        if(!sink->bufs[idx]) {
+            while(idx > 0)
+                outFreeBuf(sink->bufs[--idx]);
+
+            return ERR_NO_MEMORY;
+        }
+    }
+
+#ifdef OUT_SPLICE // Pipes accept buffer pages without copying
+    sink->splicePipe = fstat(OUT_FD, &outStat) == 0 && S_ISFIFO(outStat.st_mode);
+#endif
+
+#ifdef OUT_ASYNC
+    pthread_mutex_init(&sink->lock, NULL);
+    pthread_cond_init(&sink->ready, NULL);
+    pthread_cond_init(&sink->space, NULL);
+    sink->threaded = pthread_create(&sink->writer, NULL, outWriterMain, sink) == 0;
+#endif
+
+    return 0;
+}
+
+
+// Writes all buffered output, stops writer thread and releases buffers
+// Statistics in `sink` remain valid after closing
+void outClose(OutputSink* sink) {
+    int idx;
+
+    outSubmit(sink); // Queue partially filled buffer
+
+#ifdef OUT_ASYNC
+    if(sink->threaded) { // Let writer drain queue and exit
+        pthread_mutex_lock(&sink->lock);
+        sink->closing = 1;
+        pthread_cond_signal(&sink->ready);
+        pthread_mutex_unlock(&sink->lock);
+        pthread_join(sink->writer, NULL);
+        sink->threaded = 0;
+    }
+
+    pthread_mutex_destroy(&sink->lock);
+    pthread_cond_destroy(&sink->ready);
+    pthread_cond_destroy(&sink->space);
+#endif
+
+    for(idx = 0; idx < OUT_NUM_BUFS; idx++) { // Release buffers
+        outFreeBuf(sink->bufs[idx]);
+        sink->bufs[idx] = NULL;
+    }
+}
+
+
+// Formats output like printf into current output buffer
+// Full buffers are handed to writer thread
+void outPrintf(const char* format, ...) {
+    OutputSink* sink = &outSink;
+    size_t space = OUT_BUF_SIZE - sink->lens[sink->fillIdx]; // Room left in buffer
+    char* large; // Holds output that did not fit in current buffer
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(sink->bufs[sink->fillIdx] + sink->lens[sink->fillIdx], space, format, args);
+    va_end(args);
+
+    if(len < 0) // Formatting error, nothing written
+        return;
+
+    if((size_t)len < space) { // Output fit in current buffer
+        sink->lens[sink->fillIdx] += len;
+        return;
+    }
+
+    // Format again into separate memory and copy in across buffers
+    large = malloc((size_t)len + 1);
+
+    if(!large)
+        return;
+
+    va_start(args, format);
+    vsnprintf(large, (size_t)len + 1, format, args);
+    va_end(args);
+
+    outWrite(large, (size_t)len);
+    free(large);
+}
+
+
+// Copies `len` bytes of `data` into output buffers
+// Full buffers are handed to writer thread
+void outWrite(const char* data, size_t len) {
+    OutputSink* sink = &outSink;
+    size_t chunk; // Bytes copied into current buffer
+
+    while(len > 0) {
+        if(sink->lens[sink->fillIdx] == OUT_BUF_SIZE) // Current buffer full
+            outSubmit(sink);
+
+        chunk = OUT_BUF_SIZE - sink->lens[sink->fillIdx];
+
+        if(chunk > len)
+            chunk = len;
+
+        memcpy(sink->bufs[sink->fillIdx] + sink->lens[sink->fillIdx], data, chunk);
+        sink->lens[sink->fillIdx] += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+
+// Writes single character to output like putchar
+static inline void outPutc(int c) {
+    OutputSink* sink = &outSink;
+
+    if(sink->lens[sink->fillIdx] == OUT_BUF_SIZE) // Current buffer full
+        outSubmit(sink);
+
+    sink->bufs[sink->fillIdx][sink->lens[sink->fillIdx]++] = (char)c;
+}
+
+
+// Hands buffer being filled to writer and moves on to next buffer
+// Waits if every buffer is queued, recording time spent waiting
+// Writes synchronously when writer thread is not running
+static void outSubmit(OutputSink* sink) {
+    if(sink->lens[sink->fillIdx] == 0) // Nothing to write
+        return;
+
+#ifdef OUT_ASYNC
+    if(sink->threaded) {
+        double waitStart; // Time decoder began waiting
+
+        pthread_mutex_lock(&sink->lock);
+        sink->queued++;
+        pthread_cond_signal(&sink->ready);
+        sink->fillIdx = (sink->fillIdx + 1) % OUT_NUM_BUFS;
+
+        if(sink->queued == OUT_NUM_BUFS) { // Next buffer still queued, wait for writer
+            waitStart = monotonicMs();
+            sink->waits++;
+
+            while(sink->queued == OUT_NUM_BUFS)
+                pthread_cond_wait(&sink->space, &sink->lock);
+
+            sink->waitMs += monotonicMs() - waitStart;
+        }
+
+        pthread_mutex_unlock(&sink->lock);
+        sink->lens[sink->fillIdx] = 0; // Start next buffer empty
+        return;
+    }
+#endif
+
+    outDrain(sink, sink->fillIdx, 1); // No writer thread, write immediately
+    sink->lens[sink->fillIdx] = 0;
+}
+
+
+#ifdef OUT_ASYNC
+// Returns current time of monotonic clock in milliseconds
+static inline double monotonicMs(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+
+// Writer thread entry point
+// Drains every queued buffer in one call until sink is closed and empty
+static void* outWriterMain(void* arg) {
+    OutputSink* sink = arg;
+    int first, count;
+
+    pthread_mutex_lock(&sink->lock);
+
+    for(;;) {
+        while(sink->queued == 0 && !sink->closing) // Wait for output
+            pthread_cond_wait(&sink->ready, &sink->lock);
+
+        if(sink->queued == 0) // Closing with nothing left to write
+            break;
+
+        first = sink->drainIdx;
+        count = sink->queued;
+        pthread_mutex_unlock(&sink->lock);
+
+        outDrain(sink, first, count); // Write without holding lock
+
+        pthread_mutex_lock(&sink->lock);
+        sink->drainIdx = (first + count) % OUT_NUM_BUFS;
+        sink->queued -= count;
+        pthread_cond_signal(&sink->space);
+    }
+
+    pthread_mutex_unlock(&sink->lock);
+
+    return NULL;
+}
+
+
+// Advances `iov` past `written` bytes, skipping entries fully written
+// Returns index of first entry with bytes remaining
+static inline int advanceIov(struct iovec* iov, int idx, int count, size_t written) {
+    while(idx < count && written >= iov[idx].iov_len) { // Entries fully written
+        written -= iov[idx].iov_len;
+        idx++;
+    }
+
+    if(idx < count) { // Entry partially written
+        iov[idx].iov_base = (char*)iov[idx].iov_base + written;
+        iov[idx].iov_len -= written;
+    }
+
+    return idx;
+}
+
+
+// Writes `count` buffers starting at buffer `first` to standard output
+// Pipes are handed buffer pages with vmsplice, other outputs use one writev per batch
+static void outDrain(OutputSink* sink, int first, int count) {
+    struct iovec iov[OUT_NUM_BUFS]; // Queued buffers in order
+    ssize_t written;
+    int idx;
+#ifdef OUT_SPLICE
+    char* fresh[OUT_NUM_BUFS]; // Replace spliced buffers which pipe still references
+    int buf = 0, spliced = 0;
+#endif
+
+    for(idx = 0; idx < count; idx++) { // Gather buffers
+        iov[idx].iov_base = sink->bufs[(first + idx) % OUT_NUM_BUFS];
+        iov[idx].iov_len = sink->lens[(first + idx) % OUT_NUM_BUFS];
+    }
+
+    idx = 0;
+
+#ifdef OUT_SPLICE
+    if(sink->splicePipe) {
+        for(buf = 0; buf < count; buf++) { // Allocate replacements before giving pages away
+            fresh[buf] = outAllocBuf();
+
+            if(!fresh[buf]) { // Copy this batch instead
+                while(buf > 0)
+                    outFreeBuf(fresh[--buf]);
+
+                break;
+            }
+        }
+
+        while(buf == count && idx < count) { // Splice pages into pipe
+            written = vmsplice(OUT_FD, iov + idx, count - idx, SPLICE_F_GIFT);
+
+            if(written < 0) {
+                if(errno == EINTR) // Interrupted, retry
+                    continue;
+
+                if(!spliced) // Output does not accept splicing, copy from now on
+                    sink->splicePipe = 0;
+
+                break;
+            }
+
+            spliced = 1;
+            idx = advanceIov(iov, idx, count, (size_t)written);
+        }
+
+        if(buf == count) { // Swap in replacements if any page was spliced
+            for(buf = 0; buf < count; buf++) {
+                if(spliced) {
+                    outFreeBuf(sink->bufs[(first + buf) % OUT_NUM_BUFS]);
+                    sink->bufs[(first + buf) % OUT_NUM_BUFS] = fresh[buf];
+                } else {
+                    outFreeBuf(fresh[buf]);
+                }
+            }
+        }
+    }
+#endif
+
+    while(idx < count) { // Copy remaining bytes
+        written = writev(OUT_FD, iov + idx, count - idx);
+
+        if(written < 0) {
+            if(errno == EINTR) // Interrupted, retry
+                continue;
+
+            break; // Output closed or failed, nothing more can be written
+        }
+
+        idx = advanceIov(iov, idx, count, (size_t)written);
+    }
+}
+#else
+// Writes `count` buffers starting at buffer `first` to standard output
+static void outDrain(OutputSink* sink, int first, int count) {
+    int idx;
+
+    for(idx = 0; idx < count; idx++)
+        fwrite(sink->bufs[(first + idx) % OUT_NUM_BUFS], 1, sink->lens[(first + idx) % OUT_NUM_BUFS], stdout);
+
+    fflush(stdout);
+}
+#endif
+
+
+// Allocates one output buffer of OUT_BUF_SIZE bytes
+// Buffers are whole pages when they may be spliced into pipes
+// Returns NULL on failure
+static inline char* outAllocBuf(void) {
+#ifdef OUT_SPLICE
+    void* buf = mmap(NULL, OUT_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return buf == MAP_FAILED ? NULL : buf;
+#else
+    return malloc(OUT_BUF_SIZE);
+#endif
+}
+
+
+// Releases buffer allocated with outAllocBuf
+// Pages already spliced stay valid for pipe after release
+static inline void outFreeBuf(char* buf) {
+    if(!buf)
+        return;
+
+#ifdef OUT_SPLICE
+    munmap(buf, OUT_BUF_SIZE);
+#else
+    free(buf);
+#endif
+}
+
+
+// Prints decoding statistics to stderr
+// Formatting defined by STATS_ macro constants at top of file
+void printStats(const OutputSink* sink, const DecodeContext* ctx) {
+    fprintf(stderr, STATS_LBL);
+    fprintf(stderr, STATS_FRAMES_LBL, ctx->counts.frames);
+    fprintf(stderr, STATS_SAMPLED_LBL, ctx->counts.sampled);
+    fprintf(stderr, STATS_SKIPPED_LBL, ctx->counts.skipped);
+    fprintf(stderr, STATS_DUPLICATES_LBL, ctx->counts.duplicates);
+
+    if(ctx->opts->writePath || ctx->opts->splitDir) { // Frames copied to captures
+        fprintf(stderr, STATS_WRITTEN_LBL, ctx->writer.written);
+        fprintf(stderr, STATS_CAPTURES_LBL, ctx->writer.numFlows);
+    }
+
+    if(ipAnon.enabled) { // Addresses mapped through anonymizer, frames written or displayed are dropped
+        fprintf(stderr, STATS_ANON_DROPPED_LBL, ctx->writer.dropped + ctx->counts.anonDropped);
+        fprintf(stderr, STATS_ANON_LBL, ANON_ISA, ipAnon.lookups);
+        fprintf(stderr, STATS_ANON_HITS_LBL, ipAnon.hits);
+        fprintf(stderr, STATS_ANON_PREFIX_LBL, ipAnon.prefixHits);
+    }
+
+    fprintf(stderr, STATS_OUT_WAITS_LBL, sink->waits);
+    fprintf(stderr, STATS_OUT_WAIT_MS_LBL, sink->waitMs);
+    fprintf(stderr, "\n");
+}
+
+
+// Counts every frame of capture into top talker sketches and prints top N tables
+// Records are split between opts->threads threads in chunks of HH_CHUNK_RECORDS,
+// each thread counting into its own sketches which are merged once all finish
+// Returns 0 on success, ERR_NO_MEMORY, ERR_HH_BUDGET or ERR_FILE_NOT_OPEN otherwise
+int topTalkers(FILE* packetData, DecodeContext* ctx) {
+    const DecodeOptions* opts = ctx->opts;
+    HHWorker* workers;
+    long* chunkStarts = NULL; // Offset of first record of each chunk
+    long numChunks = 0, firstChunk, lastChunk;
+    long fileEnd = fileSize(packetData); // Records must end before this offset
+    int numWorkers = (int)opts->threads, idx, errCode = 0;
+
+    readCaptureHeader(packetData, &ctx->capture);
+
+    if(numWorkers > 1 && ctx->capture.isPcap) { // Find where each chunk of records starts
+        errCode = indexCapture(packetData, &ctx->capture, fileEnd, &chunkStarts, &numChunks);
+
+        if(numChunks < numWorkers) // Every thread needs at least one chunk
+            numWorkers = numChunks > 0 ? (int)numChunks : 1;
+    } else { // Single thread counts whole capture
+        numWorkers = 1;
+    }
+
+    workers = errCode ? NULL : calloc(numWorkers, sizeof(HHWorker));
+
+    if(!workers) {
+        free(chunkStarts);
+        return ERR_NO_MEMORY;
+    }
+
+    for(idx = 0; idx < numWorkers && !errCode; idx++) { // Give each thread its own state and records
+        workers[idx].ctx = *ctx; // Shares options, capture layout and search automaton
+        memset(&workers[idx].ctx.results, 0, sizeof(SearchResults));
+        memset(&workers[idx].ctx.sampler, 0, sizeof(SamplerState));
+        memset(&workers[idx].ctx.counts, 0, sizeof(FrameCounts));
+        memset(&workers[idx].ctx.dedup, 0, sizeof(DedupState));
+        workers[idx].fileEnd = fileEnd;
+
+        if(numWorkers == 1) { // Count every record after capture header
+            workers[idx].start = ftell(packetData);
+            workers[idx].maxRecords = -1;
+        } else { // Count contiguous run of chunks
+            firstChunk = idx * numChunks / numWorkers;
+            lastChunk = (idx + 1) * numChunks / numWorkers;
+            workers[idx].start = chunkStarts[firstChunk];
+            workers[idx].maxRecords = (lastChunk - firstChunk) * HH_CHUNK_RECORDS;
+        }
+
+        errCode = hhInit(&workers[idx].hh, opts->budgetKB, opts->topN);
+
+        if(!errCode && opts->dedupWindow > 0) // Each thread keeps own fingerprints
+            errCode = dedupInit(&workers[idx].ctx.dedup);
+    }
+
+    if(!errCode) { // Count records
+#ifdef HAVE_PTHREADS
+        for(idx = 1; idx < numWorkers; idx++) // Extra threads, run inline if they cannot start
+            workers[idx].started = pthread_create(&workers[idx].thread, NULL, hhWorkerMain, &workers[idx]) == 0;
+#endif
+
+        for(idx = 0; idx < numWorkers; idx++) {
+            if(!workers[idx].started) // Count on calling thread
+                hhWorkerMain(&workers[idx]);
+        }
+
+        for(idx = 0; idx < numWorkers; idx++) { // Wait for threads then merge into first
+#ifdef HAVE_PTHREADS
+            if(workers[idx].started)
+                pthread_join(workers[idx].thread, NULL);
+#endif
+
+            if(!errCode)
+                errCode = workers[idx].errCode;
+
+            if(idx > 0)
+                hhMerge(&workers[0].hh, &workers[idx].hh);
+
+            ctx->counts.frames += workers[idx].ctx.counts.frames;
+            ctx->counts.sampled += workers[idx].ctx.counts.sampled;
+            ctx->counts.skipped += workers[idx].ctx.counts.skipped;
+            ctx->counts.duplicates += workers[idx].ctx.counts.duplicates;
+        }
+
+        if(!errCode)
+            printTopTalkers(&workers[0].hh, opts->topN);
+    }
+
+    for(idx = 0; idx < numWorkers; idx++) { // Release per-thread state
+        hhFree(&workers[idx].hh);
+        dedupFree(&workers[idx].ctx.dedup);
+        free(workers[idx].ctx.results.items);
+        free(workers[idx].ctx.frameBuf);
+    }
+
+    free(workers);
+    free(chunkStarts);
+
+    return errCode;
+}
+
+
+// Records offset of every HH_CHUNK_RECORDS-th record so threads can start mid-capture
+// Only record headers are read, frames are skipped by length
+// packetData must point to first record, and is left pointing at first record
+// Returns 0 on success or ERR_NO_MEMORY if offsets could not be stored
+int indexCapture(FILE* packetData, const CaptureInfo* info, long fileEnd,
+                 long** chunkStarts, long* numChunks) {
+    CaptureRecord record;
+    long firstRecord = ftell(packetData), recordStart;
+    long records = 0, capacity = 0;
+    long* grown;
+
+    *chunkStarts = NULL;
+    *numChunks = 0;
+
+    for(recordStart = firstRecord; !readCaptureRecord(packetData, info, fileEnd, &record);
+        recordStart = ftell(packetData)) {
+        if(records++ % HH_CHUNK_RECORDS == 0) { // First record of chunk
+            if(*numChunks == capacity) { // Grow offsets
+                capacity = capacity ? capacity * 2 : 64;
+                grown = realloc(*chunkStarts, capacity * sizeof(long));
+
+                if(!grown) {
+                    fseek(packetData, firstRecord, SEEK_SET);
+                    return ERR_NO_MEMORY;
+                }
+
+                *chunkStarts = grown;
+            }
+
+            (*chunkStarts)[(*numChunks)++] = recordStart;
+        }
+
+        fseek(packetData, record.len, SEEK_CUR); // Skip frame
+    }
+
+    fseek(packetData, firstRecord, SEEK_SET); // Restore position
+
+    return 0;
+}
+
+
+// Counts up to worker->maxRecords records starting at worker->start into worker's sketches
+// Opens its own handle on capture so threads read independently
+// Thread entry point, also called directly when counting on calling thread
+static void* hhWorkerMain(void* arg) {
+    HHWorker* worker = arg;
+    DecodeContext* ctx = &worker->ctx;
+    CaptureRecord record;
+    FlowFields fields;
+    FILE* packetData = fopen(ctx->opts->path, "rb");
+    long records = 0, frameStart;
+
+    if(!packetData) {
+        worker->errCode = ERR_FILE_NOT_OPEN;
+        return NULL;
+    }
+
+    fseek(packetData, worker->start, SEEK_SET);
+
+    while(!worker->errCode && (worker->maxRecords < 0 || records < worker->maxRecords)
+          && !readCaptureRecord(packetData, &ctx->capture, worker->fileEnd, &record)) {
+        frameStart = ftell(packetData);
+        records++;
+        ctx->counts.frames++;
+
+        if(!sampleFrame(packetData, record.len, record.time, ctx)) { // Skip by record length
+            ctx->counts.skipped++;
+            fseek(packetData, frameStart + record.len, SEEK_SET);
+            continue;
+        }
+
+        ctx->counts.sampled++;
+
+        if(ctx->opts->dedupWindow > 0 && isDuplicate(packetData, record.len, record.time, ctx)) {
+            ctx->counts.duplicates++; // Mirrored copy is not counted twice
+            fseek(packetData, frameStart + record.len, SEEK_SET);
+            continue;
+        }
+
+        if(ctx->opts->numPatterns > 0) { // Only count frames matching search patterns
+            worker->errCode = searchFrame(packetData, record.len, ctx);
+
+            if(worker->errCode || ctx->results.count == 0) {
+                fseek(packetData, frameStart + record.len, SEEK_SET);
+                continue;
+            }
+        }
+
+        if(!peekFlowFields(packetData, record.len, &fields)) // Count IPv4 frames
+            hhAddFrame(&worker->hh, &fields, record.len);
+
+        fseek(packetData, frameStart + record.len, SEEK_SET); // Move to next record
+    }
+
+    fclose(packetData);
+
+    return NULL;
+}
+
+
+// Allocates sketches fitting in `budgetKB` of memory
+// Budget is split evenly between categories, then between Count-Min sketch and summaries
+// Returns 0 on success, ERR_HH_BUDGET if summaries cannot hold `topN` keys or ERR_NO_MEMORY
+int hhInit(HeavyHitters* hh, unsigned long budgetKB, unsigned long topN) {
+    size_t categoryBytes = (size_t)budgetKB * 1024 / HH_NUM_CATEGORIES;
+    size_t rowBytes = HH_DEPTH * HH_NUM_METRICS * sizeof(uint64_t); // Bytes per sketch column
+    size_t summaryBytes = categoryBytes / 2 / HH_NUM_METRICS;
+    uint32_t width = HH_MIN_WIDTH, slots = 2;
+    int capacity, cat, metric;
+
+    memset(hh, 0, sizeof(*hh));
+
+    while((size_t)width * 2 * rowBytes <= categoryBytes / 2) // Widest power of 2 within half
+        width *= 2;
+
+    // Each key needs a heap entry and up to 4 hash slots
+    capacity = (int)(summaryBytes / (sizeof(HHEntry) + 4 * sizeof(int32_t)));
+
+    if((size_t)width * rowBytes > categoryBytes / 2 || capacity < (long)topN)
+        return ERR_HH_BUDGET;
+
+    while(slots < 2 * (uint32_t)capacity) // Keep hash table at most half full
+        slots *= 2;
+
+    for(cat = 0; cat < HH_NUM_CATEGORIES; cat++) {
+        hh->sketch[cat].cells = calloc((size_t)width * HH_DEPTH * HH_NUM_METRICS, sizeof(uint64_t));
+        hh->sketch[cat].widthMask = width - 1;
+
+        if(!hh->sketch[cat].cells) {
+            hhFree(hh);
+            return ERR_NO_MEMORY;
+        }
+
+        for(metric = 0; metric < HH_NUM_METRICS; metric++) {
+            hh->top[cat][metric].heap = malloc(capacity * sizeof(HHEntry));
+            hh->top[cat][metric].slots = malloc(slots * sizeof(int32_t));
+            hh->top[cat][metric].capacity = capacity;
+            hh->top[cat][metric].slotMask = slots - 1;
+
+            if(!hh->top[cat][metric].heap || !hh->top[cat][metric].slots) {
+                hhFree(hh);
+                return ERR_NO_MEMORY;
+            }
+
+            memset(hh->top[cat][metric].slots, 0xFF, slots * sizeof(int32_t)); // All HH_SLOT_EMPTY
+        }
+    }
+
+    return 0;
+}
+
+
+// Releases memory held by sketches allocated with hhInit
+void hhFree(HeavyHitters* hh) {
+    int cat, metric;
+
+    for(cat = 0; cat < HH_NUM_CATEGORIES; cat++) {
+        free(hh->sketch[cat].cells);
+
+        for(metric = 0; metric < HH_NUM_METRICS; metric++) {
+            free(hh->top[cat][metric].heap);
+            free(hh->top[cat][metric].slots);
+        }
+    }
+
+    memset(hh, 0, sizeof(*hh));
+}
+
+
+// Counts one frame of `frameLen` bytes against its addresses, ports and address pair
+void hhAddFrame(HeavyHitters* hh, const FlowFields* fields, long frameLen) {
+    hhAdd(hh, HH_SOURCES, fields->srcIP, frameLen);
+    hhAdd(hh, HH_DESTINATIONS, fields->destIP, frameLen);
+
+    if(fields->hasPorts) { // Frame counts once for each distinct port
+        hhAdd(hh, HH_PORTS, fields->srcPort, frameLen);
+
+        if(fields->destPort != fields->srcPort)
+            hhAdd(hh, HH_PORTS, fields->destPort, frameLen);
+    }
+
+    hhAdd(hh, HH_PAIRS, ((uint64_t)fields->srcIP << 32) | fields->destIP, frameLen);
+}
+
+
+// Adds one packet of `frameLen` bytes to `key` in `category`
+// Sketch estimate decides whether untracked key displaces lightest tracked key
+static inline void hhAdd(HeavyHitters* hh, int category, uint64_t key, long frameLen) {
+    uint64_t weights[HH_NUM_METRICS] = {1, (uint64_t)frameLen};
+    uint64_t estimates[HH_NUM_METRICS];
+
+    cmAdd(&hh->sketch[category], key, weights, estimates);
+    ssOffer(&hh->top[category][HH_PACKETS], key, weights[HH_PACKETS], estimates[HH_PACKETS]);
+    ssOffer(&hh->top[category][HH_BYTES], key, weights[HH_BYTES], estimates[HH_BYTES]);
+}
+
+
+// Merges sketches of another thread into `dest`
+// Both must have been allocated with same budget
+void hhMerge(HeavyHitters* dest, const HeavyHitters* src) {
+    const HHSummary* summary;
+    size_t cell, numCells = ((size_t)dest->sketch[0].widthMask + 1) * HH_DEPTH * HH_NUM_METRICS;
+    int cat, metric, idx;
+
+    for(cat = 0; cat < HH_NUM_CATEGORIES; cat++) {
+        for(cell = 0; cell < numCells; cell++) // Sketches of same size add cell by cell
+            dest->sketch[cat].cells[cell] += src->sketch[cat].cells[cell];
+
+        for(metric = 0; metric < HH_NUM_METRICS; metric++) { // Offer keys using merged estimates
+            summary = &src->top[cat][metric];
+
+            for(idx = 0; idx < summary->size; idx++)
+                ssOffer(&dest->top[cat][metric], summary->heap[idx].key, summary->heap[idx].count,
+                        cmEstimate(&dest->sketch[cat], summary->heap[idx].key, metric));
+        }
+    }
+}
+
+
+// Adds `weights` to counters of `key` in each row of Count-Min sketch
+// Row positions come from two halves of one hash, `estimates` receives new minimum of each metric
+static inline void cmAdd(CMSketch* sketch, uint64_t key, const uint64_t* weights, uint64_t* estimates) {
+    uint64_t hash = mixBits(key);
+    uint32_t step = (uint32_t)(hash >> 32) | 1; // Odd step reaches every column
+    uint64_t* cell;
+    int row, metric;
+
+    for(metric = 0; metric < HH_NUM_METRICS; metric++)
+        estimates[metric] = UINT64_MAX;
+
+    for(row = 0; row < HH_DEPTH; row++) {
+        cell = sketch->cells + (((size_t)row * (sketch->widthMask + 1)
+                                 + (((uint32_t)hash + row * step) & sketch->widthMask)) * HH_NUM_METRICS);
+
+        for(metric = 0; metric < HH_NUM_METRICS; metric++) {
+            cell[metric] += weights[metric];
+
+            if(cell[metric] < estimates[metric])
+                estimates[metric] = cell[metric];
+        }
+    }
+}
+
+
+// Returns Count-Min estimate of `metric` for `key`, never below true total
+static inline uint64_t cmEstimate(const CMSketch* sketch, uint64_t key, int metric) {
+    uint64_t hash = mixBits(key);
+    uint32_t step = (uint32_t)(hash >> 32) | 1;
+    uint64_t estimate = UINT64_MAX, count;
+    int row;
+
+    for(row = 0; row < HH_DEPTH; row++) {
+        count = sketch->cells[((size_t)row * (sketch->widthMask + 1)
+                               + (((uint32_t)hash + row * step) & sketch->widthMask)) * HH_NUM_METRICS + metric];
+
+        if(count < estimate)
+            estimate = count;
+    }
+
+    return estimate;
+}
+
+
+// Adds `weight` to `key` in Space-Saving summary
+// Untracked keys are tracked while room remains, then only replace lightest key
+// once their sketch `estimate` exceeds its count; counts never exceed `estimate`
+static void ssOffer(HHSummary* summary, uint64_t key, uint64_t weight, uint64_t estimate) {
+    int32_t slot = ssFindSlot(summary, key);
+    int pos;
+    uint64_t count;
+
+    if(summary->slots[slot] != HH_SLOT_EMPTY) { // Key already tracked
+        pos = summary->slots[slot];
+        count = summary->heap[pos].count + weight;
+        summary->heap[pos].count = count < estimate ? count : estimate;
+        ssSiftDown(summary, pos);
+    } else if(summary->size < summary->capacity) { // Room to track key
+        pos = summary->size++;
+        summary->heap[pos].key = key;
+        summary->heap[pos].count = estimate;
+        summary->heap[pos].slot = slot;
+        summary->slots[slot] = pos;
+        ssSiftUp(summary, pos);
+    } else if(estimate > summary->heap[0].count) { // Key outweighs lightest tracked key
+        ssRemoveSlot(summary, summary->heap[0].slot);
+        slot = ssFindSlot(summary, key); // Removal may have shifted slots
+
+        summary->heap[0].key = key;
+        summary->heap[0].count = estimate;
+        summary->heap[0].slot = slot;
+        summary->slots[slot] = 0;
+        ssSiftDown(summary, 0);
+    }
+}
+
+
+// Returns slot holding `key`, or empty slot where it belongs if untracked
+// Slots are probed linearly from key's hash
+static inline int32_t ssFindSlot(const HHSummary* summary, uint64_t key) {
+    uint32_t slot = (uint32_t)mixBits(key) & summary->slotMask;
+
+    while(summary->slots[slot] != HH_SLOT_EMPTY && summary->heap[summary->slots[slot]].key != key)
+        slot = (slot + 1) & summary->slotMask;
+
+    return (int32_t)slot;
+}
+
+
+// Empties `slot`, shifting later slots of same probe run back to close gap
+static void ssRemoveSlot(HHSummary* summary, int32_t slot) {
+    uint32_t hole = (uint32_t)slot, next = ((uint32_t)slot + 1) & summary->slotMask, home;
+
+    summary->slots[hole] = HH_SLOT_EMPTY;
+
+    while(summary->slots[next] != HH_SLOT_EMPTY) {
+        home = (uint32_t)mixBits(summary->heap[summary->slots[next]].key) & summary->slotMask;
+
+        // Entry may move into hole when hole lies between its home slot and current slot
+        if(((next - home) & summary->slotMask) >= ((next - hole) & summary->slotMask)) {
+            summary->slots[hole] = summary->slots[next];
+            summary->heap[summary->slots[hole]].slot = (int32_t)hole;
+            summary->slots[next] = HH_SLOT_EMPTY;
+            hole = next;
+        }
+
+        next = (next + 1) & summary->slotMask;
+    }
+}
+
+
+// Swaps heap entries at `a` and `b`, keeping their slots pointed at them
+static inline void ssSwap(HHSummary* summary, int a, int b) {
+    HHEntry entry = summary->heap[a];
+
+    summary->heap[a] = summary->heap[b];
+    summary->heap[b] = entry;
+    summary->slots[summary->heap[a].slot] = a;
+    summary->slots[summary->heap[b].slot] = b;
+}
+
+
+// Moves entry at `pos` toward leaves until no child is lighter
+static void ssSiftDown(HHSummary* summary, int pos) {
+    int child;
+
+    while((child = 2 * pos + 1) < summary->size) {
+        if(child + 1 < summary->size && summary->heap[child + 1].count < summary->heap[child].count)
+            child++; // Lighter child
+
+        if(summary->heap[pos].count <= summary->heap[child].count)
+            break;
+
+        ssSwap(summary, pos, child);
+        pos = child;
+    }
+}
+
+
+// Moves entry at `pos` toward root until parent is not heavier
+static void ssSiftUp(HHSummary* summary, int pos) {
+    while(pos > 0 && summary->heap[(pos - 1) / 2].count > summary->heap[pos].count) {
+        ssSwap(summary, pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
+}
+
+
+// Orders entries heaviest first, ties broken by key
+static int compareEntries(const void* a, const void* b) {
+    const HHEntry* left = a;
+    const HHEntry* right = b;
+
+    if(left->count != right->count)
+        return left->count < right->count ? 1 : -1;
+
+    return (left->key > right->key) - (left->key < right->key);
+}
+
+
+// Prints heaviest `topN` keys of every category by packets and by bytes
+// Formatting defined by HH_ macro constants at top of file
+void printTopTalkers(const HeavyHitters* hh, unsigned long topN) {
+    static const char* const categoryNames[HH_NUM_CATEGORIES] = HH_CATEGORY_NAMES;
+    static const char* const metricNames[HH_NUM_METRICS] = HH_METRIC_NAMES;
+    const HHSummary* summary;
+    HHEntry* sorted;
+    char keyText[HH_KEY_LEN]; // Formatted key
+    uint32_t src, dest;
+    int cat, metric, idx, rows;
+
+    for(cat = 0; cat < HH_NUM_CATEGORIES; cat++) {
+        for(metric = 0; metric < HH_NUM_METRICS; metric++) {
+            summary = &hh->top[cat][metric];
+            rows = summary->size < (long)topN ? summary->size : (int)topN;
+
+            if(cat > 0 || metric > 0) // Separate from previous table
+                outPrintf(HH_TABLE_DELIM);
+
+            outPrintf(HH_LBL, (int)topN, categoryNames[cat], metricNames[metric]);
+
+            // Sort copy so summary heap stays intact
+            sorted = malloc((summary->size ? summary->size : 1) * sizeof(HHEntry));
+
+            if(!sorted)
+                continue;
+
+            memcpy(sorted, summary->heap, summary->size * sizeof(HHEntry));
+            qsort(sorted, summary->size, sizeof(HHEntry), compareEntries);
+
+            for(idx = 0; idx < rows; idx++) { // Print heaviest keys
+                src = (uint32_t)(sorted[idx].key >> 32);
+                dest = (uint32_t)sorted[idx].key;
+
+                if(ipAnon.enabled && cat == HH_PAIRS) // Anonymize printed addresses
+                    src = anonymizeIP(&ipAnon, src);
+
+                if(ipAnon.enabled && cat != HH_PORTS)
+                    dest = anonymizeIP(&ipAnon, dest);
+
+                if(cat == HH_PAIRS)
+                    snprintf(keyText, sizeof(keyText), HH_PAIR_FMT, src >> 24, (src >> 16) & 0xFF,
+                             (src >> 8) & 0xFF, src & 0xFF, dest >> 24, (dest >> 16) & 0xFF,
+                             (dest >> 8) & 0xFF, dest & 0xFF);
+                else if(cat == HH_PORTS)
+                    snprintf(keyText, sizeof(keyText), HH_PORT_FMT, dest);
+                else
+                    snprintf(keyText, sizeof(keyText), HH_ADDR_FMT, dest >> 24, (dest >> 16) & 0xFF,
+                             (dest >> 8) & 0xFF, dest & 0xFF);
+
+                outPrintf(HH_ROW_FMT, idx + 1, keyText, (unsigned long long)sorted[idx].count);
+            }
+
+            free(sorted);
+        }
+    }
+}
+
+
+// Extracts header fields of `count` frames into column arrays of `cols`
+// Frame i starts `offsets[i]` bytes into `arena` and is `lengths[i]` bytes long
+// Frames too short for IPv4 and TCP headers or of other types are marked invalid, their columns
+// are left unset and nothing past the bytes needed to reject them is read
+// With AVX2, steps of 8 valid frames are loaded with 2 vector loads each and transposed into columns
+void decodeBatch(const uint8_t* arena, const int32_t* offsets, const int32_t* lengths,
+                 int count, FieldColumns* cols) {
+    int idx = 0;
+
+#if defined(BATCH_VECTOR)
+    if(BATCH_HAVE_VECTOR())
+        idx = decodeBatchVector(arena, offsets, lengths, count, cols);
+#endif
+
+    for(; idx < count; idx++) { // Remaining frames one at a time
+        cols->valid[idx] = (uint8_t)batchFrameValid(arena + offsets[idx], lengths[idx]);
+
+        if(cols->valid[idx])
+            decodeBatchFrame(arena + offsets[idx], cols, idx);
+    }
+
+    cols->count = count;
+}
+
+
+// Returns 1 if `len` bytes at `frame` hold IPv4 frame with full IP and TCP headers, else 0
+// Length is checked first so no byte past end of frame is read
+static inline int batchFrameValid(const uint8_t* frame, int32_t len) {
+    return len >= ETH_HDR_LEN + IP_MIN_HDR_LEN + TCP_MIN_HDR_LEN
+           && ((frame[ETH_TYPE_POS] << 8) | frame[ETH_TYPE_POS + 1]) == ETH_TYPE_IPV4
+           && ETH_HDR_LEN + (frame[ETH_HDR_LEN] & 0x0F) * HDR_WORD_LEN + TCP_MIN_HDR_LEN <= len;
+}
+
+
+// Extracts header fields of frame starting at `frame` into column position `idx`
+// Fixed-offset loads, used without AVX2 and for steps holding invalid frames
+static inline void decodeBatchFrame(const uint8_t* frame, FieldColumns* cols, int idx) {
+    const uint8_t* ip = frame + ETH_HDR_LEN;
+    const uint8_t* tcp = ip + (ip[0] & 0x0F) * HDR_WORD_LEN;
+
+    cols->ttl[idx] = ip[IP_TTL_POS];
+    cols->proto[idx] = ip[IP_PROTO_POS];
+    cols->srcIP[idx] = ((uint32_t)ip[IP_SRC_POS] << 24) | (ip[IP_SRC_POS + 1] << 16) | (ip[IP_SRC_POS + 2] << 8) | ip[IP_SRC_POS + 3];
+    cols->destIP[idx] = ((uint32_t)ip[IP_DEST_POS] << 24) | (ip[IP_DEST_POS + 1] << 16) | (ip[IP_DEST_POS + 2] << 8) | ip[IP_DEST_POS + 3];
+    cols->srcPort[idx] = (uint16_t)((tcp[0] << 8) | tcp[1]);
+    cols->destPort[idx] = (uint16_t)((tcp[2] << 8) | tcp[3]);
+    cols->tcpFlags[idx] = tcp[TCP_DATA_OFS_POS + 1];
+}
+
+
+// Extracts same fields as decodeBatchFrame with extractors generated from header schemas
+static inline void decodeSchemaFrame(const uint8_t* frame, FieldColumns* cols, int idx) {
+    const uint8_t* ip = frame + ETH_HDR_LEN;
+    const uint8_t* tcp = ip + getIPHeader_ihl(ip) * HDR_WORD_LEN;
+
+    cols->ttl[idx] = (uint8_t)getIPHeader_ttl(ip);
+    cols->proto[idx] = (uint8_t)getIPHeader_protocol(ip);
+    cols->srcIP[idx] = (uint32_t)getIPHeader_srcIP(ip);
+    cols->destIP[idx] = (uint32_t)getIPHeader_destIP(ip);
+    cols->srcPort[idx] = (uint16_t)getTCPHeader_srcPort(tcp);
+    cols->destPort[idx] = (uint16_t)getTCPHeader_destPort(tcp);
+    cols->tcpFlags[idx] = (uint8_t)getTCPHeader_flags(tcp);
+}
+
+
+#if defined(BATCH_VECTOR)
+// Checks and decodes whole vector steps of first `count` frames of batch
+// Frames of a step are each read with 2 16-byte loads, one from IP TTL and one from TCP header,
+// shuffled into one record of 4 32-bit fields, then records of 8 frames are transposed into columns
+// Steps holding an invalid frame are decoded one frame at a time
+// Returns number of frames handled
+BATCH_TARGET static int decodeBatchVector(const uint8_t* arena, const int32_t* offsets, const int32_t* lengths,
+                                          int count, FieldColumns* cols) {
+    // Record is source and destination addresses byte-swapped, ports byte-swapped, then TTL, protocol and flags
+    const __m256i pickIP = _mm256_setr_epi8(7, 6, 5, 4, 11, 10, 9, 8, -1, -1, -1, -1, 0, 1, -1, -1,
+                                            7, 6, 5, 4, 11, 10, 9, 8, -1, -1, -1, -1, 0, 1, -1, -1);
+    const __m256i pickTCP = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 1, 0, 3, 2, -1, -1, TCP_DATA_OFS_POS + 1, -1,
+                                             -1, -1, -1, -1, -1, -1, -1, -1, 1, 0, 3, 2, -1, -1, TCP_DATA_OFS_POS + 1, -1);
+    // Split port field into source ports then destination ports of each 128-bit half
+    const __m256i splitPorts = _mm256_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15,
+                                                0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15);
+    // Split byte field into TTLs, protocols then flags of each 128-bit half
+    const __m256i splitBytes = _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, -1, -1, -1, -1,
+                                                0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, -1, -1, -1, -1);
+    const uint8_t* ip[BATCH_VEC_WIDTH];
+    const uint8_t* tcp[BATCH_VEC_WIDTH];
+    __m256i rec[BATCH_VEC_WIDTH / 2]; // Frame i in low half and frame i + 4 in high half
+    __m256i lowPairs, lowPairs2, highPairs, highPairs2, word;
+    int idx = 0, lane, allValid;
+
+    for(; idx + BATCH_VEC_WIDTH <= count; idx += BATCH_VEC_WIDTH) { // 8 frames per step
+        allValid = 1;
+
+        for(lane = 0; lane < BATCH_VEC_WIDTH; lane++) { // TCP header follows IP header of IHL words
+            cols->valid[idx + lane] = (uint8_t)batchFrameValid(arena + offsets[idx + lane], lengths[idx + lane]);
+            allValid &= cols->valid[idx + lane];
+            ip[lane] = arena + offsets[idx + lane] + ETH_HDR_LEN;
+            tcp[lane] = ip[lane] + (cols->valid[idx + lane] ? (ip[lane][0] & 0x0F) * HDR_WORD_LEN : 0);
+        }
+
+        if(!allValid) { // Step holds invalid frame
+            for(lane = 0; lane < BATCH_VEC_WIDTH; lane++) {
+                if(cols->valid[idx + lane])
+                    decodeBatchFrame(arena + offsets[idx + lane], cols, idx + lane);
+            }
+
+            continue;
+        }
+
+        for(lane = 0; lane < BATCH_VEC_WIDTH / 2; lane++)
+            rec[lane] = _mm256_or_si256(loadFramePair(ip[lane] + IP_TTL_POS, ip[lane + 4] + IP_TTL_POS, pickIP),
+                                        loadFramePair(tcp[lane], tcp[lane + 4], pickTCP));
+
+        // Transpose 4 x 4 fields within each 128-bit half, halves already hold frames 0-3 and 4-7
+        lowPairs = _mm256_unpacklo_epi32(rec[0], rec[1]);
+        lowPairs2 = _mm256_unpacklo_epi32(rec[2], rec[3]);
+        highPairs = _mm256_unpackhi_epi32(rec[0], rec[1]);
+        highPairs2 = _mm256_unpackhi_epi32(rec[2], rec[3]);
+
+        _mm256_storeu_si256((__m256i*)(cols->srcIP + idx), _mm256_unpacklo_epi64(lowPairs, lowPairs2));
+        _mm256_storeu_si256((__m256i*)(cols->destIP + idx), _mm256_unpackhi_epi64(lowPairs, lowPairs2));
+
+        word = _mm256_shuffle_epi8(_mm256_unpacklo_epi64(highPairs, highPairs2), splitPorts);
+        word = _mm256_permute4x64_epi64(word, _MM_SHUFFLE(3, 1, 2, 0)); // Join halves
+        _mm_storeu_si128((__m128i*)(cols->srcPort + idx), _mm256_castsi256_si128(word));
+        _mm_storeu_si128((__m128i*)(cols->destPort + idx), _mm256_extracti128_si256(word, 1));
+
+        word = _mm256_shuffle_epi8(_mm256_unpackhi_epi64(highPairs, highPairs2), splitBytes);
+        word = _mm256_permutevar8x32_epi32(word, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7)); // Join halves
+        _mm_storel_epi64((__m128i*)(cols->ttl + idx), _mm256_castsi256_si128(word));
+        _mm_storel_epi64((__m128i*)(cols->proto + idx), _mm_srli_si128(_mm256_castsi256_si128(word), 8));
+        _mm_storel_epi64((__m128i*)(cols->tcpFlags + idx), _mm256_extracti128_si256(word, 1));
+    }
+
+    return idx;
+}
+
+
+// Loads 16 bytes at `first` into low half and 16 bytes at `second` into high half,
+// then rearranges bytes of both halves by `pick`
+BATCH_TARGET static inline __m256i loadFramePair(const uint8_t* first, const uint8_t* second, __m256i pick) {
+    __m256i pair = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)first)),
+                                           _mm_loadu_si128((const __m128i*)second), 1);
+
+    return _mm256_shuffle_epi8(pair, pick);
+}
+#endif
+
+
+// Sums every column of first `count` frames so both decoders can be compared
+static inline uint64_t columnChecksum(const FieldColumns* cols, int count) {
+    uint64_t sum = 0;
+    int idx;
+
+    for(idx = 0; idx < count; idx++)
+        sum = sum * 31 + cols->ttl[idx] + cols->proto[idx] + cols->srcIP[idx] + cols->destIP[idx]
+              + cols->srcPort[idx] + cols->destPort[idx] + cols->tcpFlags[idx];
+
+    return sum;
+}
+
+
+// Times per-packet field extraction against batch decoding on frames of capture
+// Up to BENCH_MAX_FRAMES frames are loaded into memory, per-packet decoder checks and reads
+// each frame with fixed-offset loads, batch decoder uses vector steps when CPU supports AVX2
+// Fixed-offset loads are also timed against schema generated extractors
+// Returns 0 on success or ERR_NO_MEMORY if frames could not be loaded
+int benchmarkDecode(FILE* packetData, DecodeContext* ctx) {
+    CaptureRecord record;
+    FieldColumns cols; // Fields of current batch
+    uint8_t* arena = NULL; // Frames stored back to back
+    uint8_t* grown;
+    int32_t offsets[BENCH_MAX_FRAMES], lengths[BENCH_MAX_FRAMES];
+    long fileEnd = fileSize(packetData);
+    size_t arenaLen = 0;
+    int numFrames = 0, idx, batch, batchLen;
+    unsigned long iter;
+    uint64_t packetSum = 0, batchSum = 0, schemaSum = 0;
+    clock_t start;
+    double packetSecs, batchSecs, schemaSecs;
+
+    readCaptureHeader(packetData, &ctx->capture);
+
+    // Load frames holding full IPv4 and TCP headers
+    while(numFrames < BENCH_MAX_FRAMES && !readCaptureRecord(packetData, &ctx->capture, fileEnd, &record)) {
+        grown = realloc(arena, arenaLen + (record.len ? record.len : 1));
+
+        if(!grown) {
+            free(arena);
+            return ERR_NO_MEMORY;
+        }
+
+        arena = grown;
+        record.len = (long)fread(arena + arenaLen, 1, record.len, packetData);
+        offsets[numFrames] = (int32_t)arenaLen;
+        lengths[numFrames] = (int32_t)record.len;
+        decodeBatch(arena, offsets + numFrames, lengths + numFrames, 1, &cols);
+
+        if(cols.valid[0]) { // Keep frame
+            arenaLen += record.len;
+            numFrames++;
+        }
+    }
+
+    start = clock(); // Per-packet fixed-offset loads
+
+    for(iter = 0; iter < ctx->opts->benchIters; iter++) {
+        for(batch = 0; batch < numFrames; batch += BATCH_SIZE) {
+            batchLen = numFrames - batch < BATCH_SIZE ? numFrames - batch : BATCH_SIZE;
+
+            for(idx = 0; idx < batchLen; idx++) {
+                if(batchFrameValid(arena + offsets[batch + idx], lengths[batch + idx]))
+                    decodeBatchFrame(arena + offsets[batch + idx], &cols, idx);
+            }
+
+            packetSum += columnChecksum(&cols, batchLen);
+        }
+    }
+
+    packetSecs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    start = clock(); // Batch decoder
+
+    for(iter = 0; iter < ctx->opts->benchIters; iter++) {
+        for(batch = 0; batch < numFrames; batch += BATCH_SIZE) {
+            batchLen = numFrames - batch < BATCH_SIZE ? numFrames - batch : BATCH_SIZE;
+            decodeBatch(arena, offsets + batch, lengths + batch, batchLen, &cols);
+            batchSum += columnChecksum(&cols, batchLen);
+        }
+    }
+
+    batchSecs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    start = clock(); // Schema generated extractors
+
+    for(iter = 0; iter < ctx->opts->benchIters; iter++) {
+        for(batch = 0; batch < numFrames; batch += BATCH_SIZE) {
+            batchLen = numFrames - batch < BATCH_SIZE ? numFrames - batch : BATCH_SIZE;
+
+            for(idx = 0; idx < batchLen; idx++)
+                decodeSchemaFrame(arena + offsets[batch + idx], &cols, idx);
+
+            schemaSum += columnChecksum(&cols, batchLen);
+        }
+    }
+
+    schemaSecs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    outPrintf(BENCH_LBL, numFrames, ctx->opts->benchIters);
+    outPrintf(BENCH_PER_PACKET_LBL, packetSecs > 0 ? numFrames * (double)ctx->opts->benchIters / packetSecs / 1e6 : 0);
+    outPrintf(BENCH_BATCH_LBL, BATCH_ISA, batchSecs > 0 ? numFrames * (double)ctx->opts->benchIters / batchSecs / 1e6 : 0);
+    outPrintf(BENCH_SCHEMA_LBL, schemaSecs > 0 ? numFrames * (double)ctx->opts->benchIters / schemaSecs / 1e6 : 0);
+    outPrintf(BENCH_MATCH_LBL, packetSum == batchSum && batchSum == schemaSum ? BENCH_MATCH : BENCH_MISMATCH);
+
+    free(arena);
+
+    return 0;
+}
+
+
+// Prepares `writer` to copy frames of capture described by `info` into output captures
+// Global header of pcap input is copied unchanged, raw frame input gets a synthesized header
+// When writing one capture, it is created immediately so bad paths are reported before decoding
+// packetData is left pointing where it was
+// Returns 0 on success, ERR_NO_MEMORY or ERR_WRITE_FAILED
+int pcapOpen(PcapWriter* writer, const DecodeOptions* opts, FILE* packetData, const CaptureInfo* info) {
+    long start = ftell(packetData); // Position to restore
+    int32_t idx;
+
+    memset(writer, 0, sizeof(*writer));
+    writer->path = opts->writePath;
+    writer->dir = opts->splitDir;
+    writer->swapped = info->swapped;
+    writer->isPcap = info->isPcap;
+    writer->newest = writer->oldest = PCAP_NO_FLOW;
+    writer->maxOpen = PCAP_MAX_OPEN;
+
+    if(info->isPcap) { // Copy header so byte order, timestamp precision and link type are kept
+        fseek(packetData, 0, SEEK_SET);
+
+        if(fread(writer->header, 1, PCAP_GLOBAL_HDR_LEN, packetData) != PCAP_GLOBAL_HDR_LEN)
+            memset(writer->header, 0, PCAP_GLOBAL_HDR_LEN);
+
+        fseek(packetData, start, SEEK_SET);
+    } else { // Describe raw frame as big-endian microsecond Ethernet capture
+        pcapPutUInt(writer->header, PCAP_MAGIC_US, 0);
+        pcapPutUInt(writer->header + 4, PCAP_VERSION, 0);
+        pcapPutUInt(writer->header + 8, 0, 0); // Time zone offset
+        pcapPutUInt(writer->header + 12, 0, 0); // Timestamp accuracy
+        pcapPutUInt(writer->header + 16, PCAP_SNAPLEN, 0);
+        pcapPutUInt(writer->header + 20, PCAP_LINKTYPE_ETHERNET, 0);
+    }
+
+    writer->bucketMask = PCAP_MIN_BUCKETS - 1;
+    writer->buckets = malloc(PCAP_MIN_BUCKETS * sizeof(int32_t));
+
+    if(!writer->buckets)
+        return ERR_NO_MEMORY;
+
+    for(idx = 0; idx < PCAP_MIN_BUCKETS; idx++)
+        writer->buckets[idx] = PCAP_NO_FLOW;
+
+    if(writer->path) // Single capture is flow 0 and stays open
+        return pcapFindFlow(writer, NULL, 0, &idx) || pcapOpenFlow(writer, idx) ? ERR_WRITE_FAILED : 0;
+
+    return 0;
+}
+
+
+// Writes remaining buffered records, closes every output capture and releases writer memory
+// Returns 0 on success or ERR_WRITE_FAILED if buffered records could not be written
+int pcapClose(PcapWriter* writer) {
+    int errCode = 0;
+    int32_t idx;
+
+    while(writer->newest != PCAP_NO_FLOW) { // Close captures still open
+        idx = writer->newest;
+
+        if(pcapCloseFlow(writer, idx))
+            errCode = ERR_WRITE_FAILED;
+
+        pcapFreeBuf(writer->flows[idx].buf);
+        writer->flows[idx].buf = NULL;
+    }
+
+    free(writer->flows); // Flow and frame counts remain valid for statistics
+    free(writer->buckets);
+    writer->flows = NULL;
+    writer->buckets = NULL;
+
+    return errCode;
+}
+
+
+// Copies record of frame `frameLen` bytes long into output capture of its flow
+// Record header of pcap input is copied unchanged, raw frames get a synthesized header
+// When anonymizing, addresses are rewritten in buffer as soon as leading frame bytes are copied,
+// frames not IPv4 may carry addresses too (ARP) so they are dropped instead of written
+// packetData must point to start of frame, and is advanced to end of frame
+// Returns 0 on success, ERR_NO_MEMORY or ERR_WRITE_FAILED
+int pcapWriteFrame(PcapWriter* writer, FILE* packetData, long frameLen) {
+    FlowFields fields;
+    PcapFlow* flow;
+    int32_t idx;
+    long len = frameLen;
+    long patchLen = 0; // Leading frame bytes kept contiguous for anonymizer
+    size_t chunk, frameStart;
+
+    if(ipAnon.enabled && peekFlowFields(packetData, frameLen, &fields)) { // Addresses cannot be rewritten
+        writer->dropped++;
+        fseek(packetData, frameLen, SEEK_CUR);
+        return 0;
+    }
+
+    if(pcapFindFlow(writer, packetData, frameLen, &idx))
+        return ERR_NO_MEMORY;
+
+    if(pcapOpenFlow(writer, idx)) // Opening may evict least recently written capture
+        return ERR_WRITE_FAILED;
+
+    flow = &writer->flows[idx];
+
+    if(ipAnon.enabled)
+        patchLen = frameLen < ANON_PATCH_LEN ? frameLen : ANON_PATCH_LEN;
+
+    // Record header and bytes to rewrite must not be split by a flush
+    if(flow->len + PCAP_RECORD_HDR_LEN + patchLen > PCAP_BUF_SIZE && pcapFlush(flow))
+        return ERR_WRITE_FAILED;
+
+    frameStart = flow->len + PCAP_RECORD_HDR_LEN;
+
+    if(writer->isPcap) { // Copy record header along with frame
+        fseek(packetData, -PCAP_RECORD_HDR_LEN, SEEK_CUR);
+        len += PCAP_RECORD_HDR_LEN;
+    } else { // Raw frame has time 0, captured whole
+        pcapPutUInt(flow->buf + flow->len, 0, 0); // Seconds
+        pcapPutUInt(flow->buf + flow->len + 4, 0, 0); // Microseconds
+        pcapPutUInt(flow->buf + flow->len + 8, (uint32_t)frameLen, 0); // Captured length
+        pcapPutUInt(flow->buf + flow->len + 12, (uint32_t)frameLen, 0); // Original length
+        flow->len += PCAP_RECORD_HDR_LEN;
+    }
+
+    if(patchLen > 0) { // Read and rewrite leading bytes before a flush can write them out
+        chunk = fread(flow->buf + flow->len, 1, (size_t)(len - frameLen + patchLen), packetData);
+        flow->len += chunk;
+        len -= (long)chunk;
+
+        if(frameLen - len > 0) // Fewer than patchLen frame bytes if input ended early
+            anonymizeFrame(&ipAnon, flow->buf + frameStart, frameLen - len);
+    }
+
+    while(len > 0) { // Read record straight into capture buffer
+        if(flow->len == PCAP_BUF_SIZE && pcapFlush(flow)) // Buffer full
+            return ERR_WRITE_FAILED;
+
+        chunk = PCAP_BUF_SIZE - flow->len;
+
+        if((long)chunk > len)
+            chunk = (size_t)len;
+
+        chunk = fread(flow->buf + flow->len, 1, chunk, packetData);
+
+        if(chunk == 0) // Input ended early
+            break;
+
+        flow->len += chunk;
+        len -= (long)chunk;
+    }
+
+    writer->written++;
+
+    return 0;
+}
+
+
+// Finds flow of frame in writer's flow table, adding it if not seen before
+// Both directions of a flow share one entry, frames not IPv4 share one entry
+// Every frame belongs to flow 0 when writing one capture
+// packetData must point to start of frame, and is left pointing at start of frame
+// Returns 0 and sets `flowIdx` on success, non-zero if table could not grow
+static int pcapFindFlow(PcapWriter* writer, FILE* packetData, long frameLen, int32_t* flowIdx) {
+    FlowFields key = {0};
+    PcapFlow* grown;
+    uint32_t bucket;
+    uint32_t swapIP;
+    uint16_t swapPort;
+    int isOther = 1;
+    int32_t idx;
+
+    if(writer->dir && !peekFlowFields(packetData, frameLen, &key)) { // Split by flow
+        isOther = 0;
+
+        // Lower endpoint first so both directions map to same key
+        if(key.srcIP > key.destIP || (key.srcIP == key.destIP && key.srcPort > key.destPort)) {
+            swapIP = key.srcIP;
+            key.srcIP = key.destIP;
+            key.destIP = swapIP;
+            swapPort = key.srcPort;
+            key.srcPort = key.destPort;
+            key.destPort = swapPort;
+        }
+    }
+
+    bucket = pcapFlowHash(&key) & writer->bucketMask;
+
+    for(idx = writer->buckets[bucket]; idx != PCAP_NO_FLOW; idx = writer->flows[idx].next) { // Search chain
+        if(writer->flows[idx].isOther == isOther && writer->flows[idx].key.srcIP == key.srcIP
+           && writer->flows[idx].key.destIP == key.destIP && writer->flows[idx].key.srcPort == key.srcPort
+           && writer->flows[idx].key.destPort == key.destPort && writer->flows[idx].key.protocol == key.protocol) {
+            *flowIdx = idx;
+            return 0;
+        }
+    }
+
+    if(writer->numFlows == writer->capacity) { // Grow flow array
+        grown = realloc(writer->flows, (writer->capacity ? writer->capacity * 2 : PCAP_MIN_BUCKETS) * sizeof(PcapFlow));
+
+        if(!grown)
+            return 1;
+
+        writer->flows = grown;
+        writer->capacity = writer->capacity ? writer->capacity * 2 : PCAP_MIN_BUCKETS;
+    }
+
+    idx = writer->numFlows++;
+    memset(&writer->flows[idx], 0, sizeof(PcapFlow));
+    writer->flows[idx].key = key;
+    writer->flows[idx].isOther = isOther;
+    writer->flows[idx].next = writer->buckets[bucket];
+    writer->flows[idx].newer = writer->flows[idx].older = PCAP_NO_FLOW;
+    writer->buckets[bucket] = idx;
+    *flowIdx = idx;
+
+    // Keep chains short, table holds at least one bucket per flow
+    if((uint32_t)writer->numFlows > writer->bucketMask + 1)
+        pcapRehash(writer);
+
+    return 0;
+}
+
+
+// Doubles buckets of writer's flow table and relinks every flow
+// Table is left unchanged if larger bucket array cannot be allocated
+static void pcapRehash(PcapWriter* writer) {
+    uint32_t mask = writer->bucketMask * 2 + 1;
+    int32_t* buckets = malloc((mask + 1) * sizeof(int32_t));
+    uint32_t bucket;
+    int32_t idx;
+
+    if(!buckets) // Keep longer chains
+        return;
+
+    for(bucket = 0; bucket <= mask; bucket++)
+        buckets[bucket] = PCAP_NO_FLOW;
+
+    for(idx = 0; idx < writer->numFlows; idx++) {
+        bucket = pcapFlowHash(&writer->flows[idx].key) & mask;
+        writer->flows[idx].next = buckets[bucket];
+        buckets[bucket] = idx;
+    }
+
+    free(writer->buckets);
+    writer->buckets = buckets;
+    writer->bucketMask = mask;
+}
+
+
+// Hashes canonical flow key of writer's flow table
+static inline uint32_t pcapFlowHash(const FlowFields* key) {
+    return (uint32_t)mixBits(((uint64_t)key->srcIP << 32 | key->destIP)
+                             ^ mixBits(((uint64_t)key->protocol << 32) | ((uint32_t)key->srcPort << 16) | key->destPort));
+}
+
+
+// Makes output capture of flow `idx` open and most recently written
+// New captures are created with global header, captures closed earlier are reopened for append
+// At writer's open limit, least recently written capture is closed and its buffer reused
+// Returns 0 on success, non-zero if capture could not be opened or evicted capture written
+static int pcapOpenFlow(PcapWriter* writer, int32_t idx) {
+    PcapFlow* flow = &writer->flows[idx];
+    char path[PCAP_PATH_LEN]; // Path of flow capture
+    const char* mode = flow->created ? "ab" : "wb"; // Reopened captures are appended to
+    FlowFields key = flow->key; // Endpoints named in path
+    uint8_t* buf;
+    int32_t victim;
+    int pathLen, closeErr;
+
+    if(flow->file) { // Already open
+        pcapUnlink(writer, idx);
+        pcapLinkNewest(writer, idx);
+        return 0;
+    }
+
+    if(ipAnon.enabled) { // Name reveals only anonymized endpoints
+        key.srcIP = anonymizeIP(&ipAnon, key.srcIP);
+        key.destIP = anonymizeIP(&ipAnon, key.destIP);
+    }
+
+    if(writer->path) // Single capture
+        pathLen = snprintf(path, PCAP_PATH_LEN, "%s", writer->path);
+    else if(flow->isOther) // Frames not IPv4
+        pathLen = snprintf(path, PCAP_PATH_LEN, PCAP_OTHER_NAME, writer->dir);
+    else
+        pathLen = snprintf(path, PCAP_PATH_LEN, PCAP_FLOW_NAME, writer->dir,
+                           key.srcIP >> 24, (key.srcIP >> 16) & 0xFF, (key.srcIP >> 8) & 0xFF, key.srcIP & 0xFF,
+                           key.srcPort,
+                           key.destIP >> 24, (key.destIP >> 16) & 0xFF, (key.destIP >> 8) & 0xFF, key.destIP & 0xFF,
+                           key.destPort, key.protocol);
+
+    if(pathLen < 0 || pathLen >= PCAP_PATH_LEN) // Path does not fit
+        return 1;
+
+    if(writer->numOpen >= writer->maxOpen) { // Evict least recently written capture
+        victim = writer->oldest;
+
+        if(pcapCloseFlow(writer, victim))
+            return 1;
+
+        buf = writer->flows[victim].buf;
+        writer->flows[victim].buf = NULL;
+    } else {
+        buf = pcapAllocBuf();
+
+        if(!buf)
+            return 1;
+    }
+
+    flow->file = fopen(path, mode);
+
+    // Descriptor limit may be below PCAP_MAX_OPEN, close older captures and lower limit until open succeeds
+    while(!flow->file && writer->numOpen > 0) {
+        writer->maxOpen = writer->numOpen;
+        victim = writer->oldest;
+        closeErr = pcapCloseFlow(writer, victim);
+        pcapFreeBuf(writer->flows[victim].buf);
+        writer->flows[victim].buf = NULL;
+
+        if(closeErr)
+            break;
+
+        flow->file = fopen(path, mode);
+    }
+
+    if(!flow->file) {
+        pcapFreeBuf(buf);
+        return 1;
+    }
+
+    setvbuf(flow->file, NULL, _IONBF, 0); // Each flush is written in one call from aligned buffer
+    flow->buf = buf;
+    flow->len = 0;
+
+    if(!flow->created) { // Start new capture with global header
+        memcpy(flow->buf, writer->header, PCAP_GLOBAL_HDR_LEN);
+        flow->len = PCAP_GLOBAL_HDR_LEN;
+        flow->created = 1;
+    }
+
+    pcapLinkNewest(writer, idx);
+    writer->numOpen++;
+
+    return 0;
+}
+
+
+// Writes buffered records of flow `idx`, closes its capture and removes it from LRU list
+// Flow keeps its buffer, it is reused or freed by caller
+// Returns 0 on success, non-zero if records could not be written
+static int pcapCloseFlow(PcapWriter* writer, int32_t idx) {
+    PcapFlow* flow = &writer->flows[idx];
+    int errCode = pcapFlush(flow);
+
+    if(fclose(flow->file) != 0)
+        errCode = 1;
+
+    flow->file = NULL;
+    pcapUnlink(writer, idx);
+    writer->numOpen--;
+
+    return errCode;
+}
+
+
+// Writes records buffered for `flow` to its capture
+// Returns 0 on success, non-zero if write failed
+static inline int pcapFlush(PcapFlow* flow) {
+    size_t len = flow->len;
+
+    flow->len = 0;
+
+    return len > 0 && fwrite(flow->buf, 1, len, flow->file) != len;
+}
+
+
+// Removes flow `idx` from writer's LRU list of open captures
+static inline void pcapUnlink(PcapWriter* writer, int32_t idx) {
+    PcapFlow* flow = &writer->flows[idx];
+
+    if(flow->newer != PCAP_NO_FLOW)
+        writer->flows[flow->newer].older = flow->older;
+    else
+        writer->newest = flow->older;
+
+    if(flow->older != PCAP_NO_FLOW)
+        writer->flows[flow->older].newer = flow->newer;
+    else
+        writer->oldest = flow->newer;
+
+    flow->newer = flow->older = PCAP_NO_FLOW;
+}
+
+
+// Puts flow `idx` at most recently written end of writer's LRU list
+static inline void pcapLinkNewest(PcapWriter* writer, int32_t idx) {
+    PcapFlow* flow = &writer->flows[idx];
+
+    flow->newer = PCAP_NO_FLOW;
+    flow->older = writer->newest;
+
+    if(writer->newest != PCAP_NO_FLOW)
+        writer->flows[writer->newest].newer = idx;
+    else
+        writer->oldest = idx;
+
+    writer->newest = idx;
+}
+
+
+// Stores `value` at `dest` as 4-byte capture header field, little-endian if `swapped`
+static inline void pcapPutUInt(uint8_t* dest, uint32_t value, int swapped) {
+    int idx;
+
+    for(idx = 0; idx < 4; idx++)
+        dest[swapped ? idx : 3 - idx] = (uint8_t)(value >> (8 * idx));
+}
+
+
+// Allocates one capture buffer of PCAP_BUF_SIZE bytes aligned to PCAP_BUF_ALIGN
+// Returns NULL on failure
+static inline uint8_t* pcapAllocBuf(void) {
+#if defined(_WIN32)
+    return _aligned_malloc(PCAP_BUF_SIZE, PCAP_BUF_ALIGN);
+#else
+    void* buf;
+
+    return posix_memalign(&buf, PCAP_BUF_ALIGN, PCAP_BUF_SIZE) == 0 ? buf : NULL;
+#endif
+}
+
+
+// Releases buffer allocated with pcapAllocBuf
+static inline void pcapFreeBuf(uint8_t* buf) {
+#if defined(_WIN32)
+    _aligned_free(buf);
+#else
+    free(buf);
+#endif
+}
+
+
+// Writes records buffered for every open capture without closing them
+// Lets other readers see frames written so far while capture is being followed
+// Returns 0 on success or ERR_WRITE_FAILED
+int pcapSync(PcapWriter* writer) {
+    int32_t idx;
+
+    for(idx = writer->newest; idx != PCAP_NO_FLOW; idx = writer->flows[idx].older) {
+        if(pcapFlush(&writer->flows[idx]))
+            return ERR_WRITE_FAILED;
+    }
+
+    return 0;
+}
+
+
+#ifdef HAVE_FOLLOW
+// Starts watching capture at `path` for appended records and replacement
+// With inotify, capture and its directory are watched, otherwise capture is polled
+// SIGINT and SIGTERM end following so output and statistics are completed
+void followInit(FollowState* follow, const char* path) {
+    struct sigaction stop;
+#ifdef FOLLOW_INOTIFY
+    char dir[FOLLOW_PATH_LEN]; // Directory holding capture
+    const char* slash = strrchr(path, '/');
+#endif
+
+    follow->path = path;
+    follow->notifyFd = -1;
+    follow->fileWatch = -1;
+    followStopped = 0;
+
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = followStop; // No SA_RESTART, so waits return when interrupted
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+
+#ifdef FOLLOW_INOTIFY
+    follow->notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if(follow->notifyFd < 0) // Poll instead
+        return;
+
+    follow->fileWatch = inotify_add_watch(follow->notifyFd, path, FOLLOW_FILE_EVENTS);
+
+    if(follow->fileWatch < 0) { // Poll instead
+        close(follow->notifyFd);
+        follow->notifyFd = -1;
+        return;
+    }
+
+    // Rotation renames capture then creates new one, directory events report new capture
+    if(!slash)
+        snprintf(dir, FOLLOW_PATH_LEN, ".");
+    else
+        snprintf(dir, FOLLOW_PATH_LEN, "%.*s", slash == path ? 1 : (int)(slash - path), path);
+
+    inotify_add_watch(follow->notifyFd, dir, FOLLOW_DIR_EVENTS);
+#endif
+}
+
+
+// Stops watching followed capture
+void followFree(FollowState* follow) {
+    if(follow->notifyFd >= 0)
+        close(follow->notifyFd);
+
+    follow->notifyFd = -1;
+}
+
+
+// Blocks until followed capture grows past `fileEnd`, is truncated or is replaced at its path
+// Replaced capture is only switched to once old one stops growing, so its last records are decoded first
+// Truncated or replaced capture is read again from start, with its header read into `info`
+// Returns 0 when more records may be ready, non-zero if interrupted
+int followNext(FollowState* follow, FILE* packetData, long fileEnd, CaptureInfo* info) {
+    long size;
+
+    for(;;) {
+        if(followWait(follow)) // Interrupted
+            return 1;
+
+        size = fileSize(packetData);
+
+        if(size > fileEnd) // Records appended
+            return 0;
+
+        fflush(packetData); // Drop bytes buffered from old contents, or stream could reread them
+
+        if(size < fileEnd || followReopen(follow, packetData)) { // Start again on new contents
+            fseek(packetData, 0, SEEK_SET);
+
+            if(followHeader(follow, packetData))
+                return 1;
+
+            readCaptureHeader(packetData, info);
+
+            return 0;
+        }
+    }
+}
+
+
+// Waits until followed capture holds complete pcap global header
+// packetData is left pointing where it was
+// Returns non-zero if interrupted first
+static int followHeader(FollowState* follow, FILE* packetData) {
+    while(fileSize(packetData) < PCAP_GLOBAL_HDR_LEN) {
+        if(followWait(follow))
+            return 1;
+    }
+
+    return 0;
+}
+
+
+// Switches packetData to file now at followed path if capture was replaced
+// New file is put beneath same stream, so callers keep using packetData
+// Returns non-zero if switched, packetData position must then be reset by caller
+static int followReopen(FollowState* follow, FILE* packetData) {
+    struct stat current, named;
+    int fd;
+
+    if(stat(follow->path, &named) != 0 || fstat(fileno(packetData), &current) != 0) // Not created yet
+        return 0;
+
+    if(named.st_dev == current.st_dev && named.st_ino == current.st_ino) // Not replaced
+        return 0;
+
+    fd = open(follow->path, O_RDONLY);
+
+    if(fd < 0)
+        return 0;
+
+    if(dup2(fd, fileno(packetData)) < 0) { // Keep following old file
+        close(fd);
+        return 0;
+    }
+
+    close(fd);
+
+#ifdef FOLLOW_INOTIFY
+    if(follow->notifyFd >= 0) { // Move file watch to new capture
+        inotify_rm_watch(follow->notifyFd, follow->fileWatch);
+        follow->fileWatch = inotify_add_watch(follow->notifyFd, follow->path, FOLLOW_FILE_EVENTS);
+    }
+#endif
+
+    return 1;
+}
+
+
+// Blocks until followed capture may have changed
+// With inotify, waits for an event, at most FOLLOW_RECHECK_MS, otherwise sleeps FOLLOW_POLL_MS
+// Returns non-zero once follower is interrupted
+static int followWait(FollowState* follow) {
+    struct timespec pause = {0, FOLLOW_POLL_MS * 1000000L};
+#ifdef FOLLOW_INOTIFY
+    char events[FOLLOW_EVENT_BUF]; // Drained events, any event means capture is checked
+    struct pollfd ready;
+
+    if(follow->notifyFd >= 0) {
+        ready.fd = follow->notifyFd;
+        ready.events = POLLIN;
+        ready.revents = 0;
+
+        if(!followStopped && poll(&ready, 1, FOLLOW_RECHECK_MS) > 0) {
+            while(read(follow->notifyFd, events, FOLLOW_EVENT_BUF) > 0)
+                continue;
+        }
+
+        return followStopped;
+    }
+#else
+    (void)follow;
+#endif
+
+    if(!followStopped)
+        nanosleep(&pause, NULL);
+
+    return followStopped;
+}
+
+
+// Signal handler ending follow mode
+static void followStop(int signum) {
+    (void)signum;
+    followStopped = 1;
+}
+#endif
+
+
+// Prepares `anon` to anonymize addresses with Crypto-PAn under `key` of ANON_KEY_LEN bytes
+// First half of key is AES key, second half is encrypted into pad filling bits past each prefix
+void anonInit(IPAnonymizer* anon, const uint8_t* key) {
+    uint32_t zeroPrefix, zeroAnon;
+    int idx;
+
+    memset(anon, 0, sizeof(*anon));
+    aesExpandKey(&anon->aes, key);
+    aesEncrypt(&anon->aes, key + AES_BLOCK_LEN, anon->pad);
+    anon->padWord = (uint32_t)readBitsBE(anon->pad, 4);
+
+    // Every slot starts with mapping of address 0, which only lookups of address 0 can match
+    zeroPrefix = anonPadBits(anon, 0, 0, ANON_PREFIX_BITS);
+    zeroAnon = zeroPrefix | anonPadBits(anon, 0, ANON_PREFIX_BITS, 32);
+
+    for(idx = 0; idx < ANON_CACHE_SIZE; idx++) {
+        anon->cache[idx].addr = 0;
+        anon->cache[idx].anon = zeroAnon;
+        anon->prefixes[idx].addr = 0;
+        anon->prefixes[idx].anon = zeroPrefix;
+    }
+
+    anon->enabled = 1;
+}
+
+
+// Returns anonymized `addr`, from cache when mapped recently
+// Leading ANON_PREFIX_BITS pad bits depend only on the address bits before them,
+// so addresses of a recently seen prefix only compute the remaining bits
+static inline uint32_t anonymizeIP(IPAnonymizer* anon, uint32_t addr) {
+    AnonEntry* entry = &anon->cache[mixBits(addr) & (ANON_CACHE_SIZE - 1)];
+    AnonEntry* prefix;
+    uint32_t high = addr >> (32 - ANON_PREFIX_BITS); // Prefix selecting cached pad bits
+
+    anon->lookups++;
+
+    if(entry->addr == addr) { // Mapped recently
+        anon->hits++;
+        return entry->anon;
+    }
+
+    prefix = &anon->prefixes[mixBits(high) & (ANON_CACHE_SIZE - 1)];
+
+    if(prefix->addr == high) { // Prefix seen recently
+        anon->prefixHits++;
+    } else {
+        prefix->addr = high;
+        prefix->anon = anonPadBits(anon, addr, 0, ANON_PREFIX_BITS);
+    }
+
+    entry->addr = addr;
+    entry->anon = addr ^ prefix->anon ^ anonPadBits(anon, addr, ANON_PREFIX_BITS, 32);
+
+    return entry->anon;
+}
+
+
+// Returns bits `firstBit` up to `endBit`, counted from most significant, of value XORed into `addr` to anonymize it
+// Bit i is first bit of AES encryption of pad with its first i bits replaced by first i bits of `addr`,
+// so it depends only on the bits before it and shared prefixes stay shared
+// Both bounds must be multiples of ANON_LANES so AES-NI can be used when CPU supports it
+static uint32_t anonPadBits(const IPAnonymizer* anon, uint32_t addr, int firstBit, int endBit) {
+    uint32_t diff = addr ^ anon->padWord; // Bits where address differs from pad
+    uint32_t prefix, bits = 0;
+    uint8_t block[AES_BLOCK_LEN], cipher[AES_BLOCK_LEN];
+    int bit;
+
+#if defined(ANON_AESNI)
+    if(ANON_HAVE_AESNI())
+        return anonPadBitsAESNI(anon, addr, firstBit, endBit);
+#endif
+
+    memcpy(block, anon->pad, AES_BLOCK_LEN);
+
+    for(bit = firstBit; bit < endBit; bit++) {
+        prefix = bit ? diff & (0xFFFFFFFFu << (32 - bit)) : 0;
+        pcapPutUInt(block, anon->padWord ^ prefix, 0); // Replace leading pad bits with address prefix
+        aesEncrypt(&anon->aes, block, cipher);
+        bits |= (uint32_t)(cipher[0] >> 7) << (31 - bit);
+    }
+
+    return bits;
+}
+
+
+#if defined(ANON_AESNI)
+// Returns same bits as anonPadBits with AES-NI
+// Blocks are independent, so ANON_LANES of them are encrypted at a time to hide round latency
+ANON_TARGET static uint32_t anonPadBitsAESNI(const IPAnonymizer* anon, uint32_t addr, int firstBit, int endBit) {
+    uint32_t diff = addr ^ anon->padWord; // Bits where address differs from pad
+    uint32_t prefix, bits = 0;
+    __m128i keys[AES_ROUNDS + 1], blocks[ANON_LANES];
+    __m128i pad = _mm_loadu_si128((const __m128i*)anon->pad);
+    int bit, lane, round;
+
+    for(round = 0; round <= AES_ROUNDS; round++)
+        keys[round] = _mm_loadu_si128((const __m128i*)(anon->aes.roundKeys + round * AES_BLOCK_LEN));
+
+    for(bit = firstBit; bit < endBit; bit += ANON_LANES) {
+        for(lane = 0; lane < ANON_LANES; lane++) { // Replace leading pad bits with address prefix
+            prefix = bit + lane ? diff & (0xFFFFFFFFu << (32 - bit - lane)) : 0;
+
+            // Vector lanes load little-endian, so swap prefix to land in leading block bytes
+            prefix = (prefix >> 24) | ((prefix >> 8) & 0xFF00) | ((prefix << 8) & 0xFF0000) | (prefix << 24);
+            blocks[lane] = _mm_xor_si128(_mm_xor_si128(pad, _mm_cvtsi32_si128((int)prefix)), keys[0]);
+        }
+
+        for(round = 1; round < AES_ROUNDS; round++) {
+            for(lane = 0; lane < ANON_LANES; lane++)
+                blocks[lane] = _mm_aesenc_si128(blocks[lane], keys[round]);
+        }
+
+        for(lane = 0; lane < ANON_LANES; lane++) { // Keep first bit of each ciphertext
+            blocks[lane] = _mm_aesenclast_si128(blocks[lane], keys[AES_ROUNDS]);
+            bits |= (uint32_t)((_mm_cvtsi128_si32(blocks[lane]) >> 7) & 1) << (31 - bit - lane);
+        }
+    }
+
+    return bits;
+}
+#endif
+
+
+// Anonymizes addresses of IPv4 frame held in first `len` bytes of `frame`
+// IP checksum and TCP or UDP checksum covering addresses are updated to match
+// Frames not IPv4, and checksums not within `len` bytes, are left unchanged
+void anonymizeFrame(IPAnonymizer* anon, uint8_t* frame, long len) {
+    uint8_t* ip = frame + ETH_HDR_LEN;
+    uint8_t* checksum; // Transport checksum
+    uint32_t src, dest, anonSrc, anonDest;
+    uint16_t sum;
+    int ipLen;
+
+    if(len < ETH_HDR_LEN + IP_MIN_HDR_LEN
+       || ((frame[ETH_TYPE_POS] << 8) | frame[ETH_TYPE_POS + 1]) != ETH_TYPE_IPV4)
+        return;
+
+    src = (uint32_t)readBitsBE(ip + IP_SRC_POS, IP_ADR_LEN);
+    dest = (uint32_t)readBitsBE(ip + IP_DEST_POS, IP_ADR_LEN);
+    anonSrc = anonymizeIP(anon, src);
+    anonDest = anonymizeIP(anon, dest);
+    pcapPutUInt(ip + IP_SRC_POS, anonSrc, 0);
+    pcapPutUInt(ip + IP_DEST_POS, anonDest, 0);
+
+    sum = (uint16_t)readBitsBE(ip + IP_CHECKSUM_POS, 2);
+    sum = checksumAdjust(checksumAdjust(sum, src, anonSrc), dest, anonDest);
+    ip[IP_CHECKSUM_POS] = (uint8_t)(sum >> 8);
+    ip[IP_CHECKSUM_POS + 1] = (uint8_t)sum;
+
+    // Addresses are in transport checksum through pseudo-header, only first fragment holds it
+    ipLen = (ip[0] & 0x0F) * HDR_WORD_LEN;
+
+    if(ipLen < IP_MIN_HDR_LEN || (readBitsBE(ip + IP_FRAG_POS, 2) & 0x1FFF) != 0)
+        return;
+
+    if(ip[IP_PROTO_POS] == IP_PROTO_TCP && ETH_HDR_LEN + ipLen + TCP_CHECKSUM_POS + 2 <= len)
+        checksum = ip + ipLen + TCP_CHECKSUM_POS;
+    else if(ip[IP_PROTO_POS] == IP_PROTO_UDP && ETH_HDR_LEN + ipLen + UDP_CHECKSUM_POS + 2 <= len)
+        checksum = ip + ipLen + UDP_CHECKSUM_POS;
+    else // No transport checksum within bytes given
+        return;
+
+    sum = (uint16_t)readBitsBE(checksum, 2);
+
+    if(sum == 0 && ip[IP_PROTO_POS] == IP_PROTO_UDP) // Sender did not compute checksum
+        return;
+
+    sum = checksumAdjust(checksumAdjust(sum, src, anonSrc), dest, anonDest);
+
+    if(sum == 0 && ip[IP_PROTO_POS] == IP_PROTO_UDP) // Zero means no checksum, UDP sends computed zero as all ones
+        sum = 0xFFFF;
+
+    checksum[0] = (uint8_t)(sum >> 8);
+    checksum[1] = (uint8_t)sum;
+}
+
+
+// Returns ones' complement checksum `sum` updated for 32-bit field changing from `from` to `to`
+// Follows incremental update of RFC 1624, sum' = ~(~sum + ~from + to)
+static inline uint16_t checksumAdjust(uint16_t sum, uint32_t from, uint32_t to) {
+    uint32_t acc = (uint16_t)~sum;
+
+    acc += (uint16_t)~(from >> 16) + (uint16_t)~from + (to >> 16) + (to & 0xFFFF);
+    acc = (acc & 0xFFFF) + (acc >> 16); // Fold carries back in
+    acc = (acc & 0xFFFF) + (acc >> 16);
+
+    return (uint16_t)~acc;
+}
+
+
+// AES substitution box
+static const uint8_t aesSbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+
+// Expands 16-byte `key` into round keys of AES-128
+// Round keys are laid out as AES-NI expects, so both encryption paths share them
+static void aesExpandKey(AESKey* aes, const uint8_t* key) {
+    uint8_t* rk = aes->roundKeys;
+    uint8_t word[4], first;
+    uint8_t rcon = 1; // Round constant
+    int pos, idx;
+
+    memcpy(rk, key, AES_BLOCK_LEN);
+
+    for(pos = AES_BLOCK_LEN; pos < AES_BLOCK_LEN * (AES_ROUNDS + 1); pos += 4) { // One word at a time
+        memcpy(word, rk + pos - 4, 4);
+
+        if(pos % AES_BLOCK_LEN == 0) { // Rotate, substitute and add round constant
+            first = word[0];
+            word[0] = aesSbox[word[1]] ^ rcon;
+            word[1] = aesSbox[word[2]];
+            word[2] = aesSbox[word[3]];
+            word[3] = aesSbox[first];
+            rcon = aesDouble(rcon);
+        }
+
+        for(idx = 0; idx < 4; idx++)
+            rk[pos + idx] = rk[pos - AES_BLOCK_LEN + idx] ^ word[idx];
+    }
+}
+
+
+// Encrypts one AES_BLOCK_LEN block `in` into `out` with AES-128
+// Portable byte-wise rounds, used where AES-NI is not available and to derive pad
+static void aesEncrypt(const AESKey* aes, const uint8_t* in, uint8_t* out) {
+    uint8_t state[AES_BLOCK_LEN], shifted[AES_BLOCK_LEN];
+    uint8_t a0, a1, a2, a3, all;
+    int round, col, row, idx;
+
+    for(idx = 0; idx < AES_BLOCK_LEN; idx++)
+        state[idx] = in[idx] ^ aes->roundKeys[idx];
+
+    for(round = 1; round <= AES_ROUNDS; round++) {
+        // Substitute bytes and shift row r left by r columns, state is column-major
+        for(col = 0; col < 4; col++) {
+            for(row = 0; row < 4; row++)
+                shifted[4 * col + row] = aesSbox[state[4 * ((col + row) & 3) + row]];
+        }
+
+        for(col = 0; col < 4; col++) { // Mix columns, skipped in final round
+            a0 = shifted[4 * col];
+            a1 = shifted[4 * col + 1];
+            a2 = shifted[4 * col + 2];
+            a3 = shifted[4 * col + 3];
+
+            if(round == AES_ROUNDS) {
+                memcpy(state + 4 * col, shifted + 4 * col, 4);
+                continue;
+            }
+
+            all = a0 ^ a1 ^ a2 ^ a3;
+            state[4 * col] = a0 ^ all ^ aesDouble(a0 ^ a1);
+            state[4 * col + 1] = a1 ^ all ^ aesDouble(a1 ^ a2);
+            state[4 * col + 2] = a2 ^ all ^ aesDouble(a2 ^ a3);
+            state[4 * col + 3] = a3 ^ all ^ aesDouble(a3 ^ a0);
+        }
+
+        for(idx = 0; idx < AES_BLOCK_LEN; idx++) // Add round key
+            state[idx] ^= aes->roundKeys[round * AES_BLOCK_LEN + idx];
+    }
+
+    memcpy(out, state, AES_BLOCK_LEN);
+}
+
+
+// Multiplies `value` by 2 in AES field GF(2^8)
+static inline uint8_t aesDouble(uint8_t value) {
+    return (uint8_t)((value << 1) ^ ((value & 0x80) ? 0x1b : 0));
+}